@@ -0,0 +1,570 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define CV_NO_BACKWARD_COMPATIBILITY
+#include <opencv/cv.h>
+#include <opencv/highgui.h>
+
+#include "features.h"
+#include "image.h"
+#include "morph.h"
+#include "objfind.h"
+
+// Every allocation the benchmarks make is counted here.  The benchmarks
+// run on one thread, so a plain counter will do.
+static size_t allocations = 0;
+
+void *
+operator new(size_t size)
+{
+  ++allocations;
+  void *p = std::malloc(size ? size : 1);
+  if (! p)
+    throw std::bad_alloc();
+  return p;
+}
+
+void
+operator delete(void *p) throw()
+{
+  std::free(p);
+}
+
+void
+operator delete(void *p, size_t) throw()
+{
+  operator delete(p);
+}
+
+// One measurement.  Rates left at zero don't apply to the benchmark.
+struct result_t {
+  std::string name;
+  double seconds;
+  double mpixels;
+  double runs;
+  double objects;
+  double allocations;
+};
+
+static std::vector<result_t> results;
+
+typedef void (*bench_fn_t)(void *);
+
+// Runs fn reps times and records the fastest run, scaled by the amount
+// of work one run does.  Allocations are per run.
+static void
+bench(const std::string &name, bench_fn_t fn, void *data, int reps,
+      double pixels, double runs, double objects)
+{
+  double best = 0.;
+  size_t allocs = 0;
+  for (int r = 0; r < reps; ++r) {
+    size_t before = allocations;
+    int64 start = cv::getTickCount();
+    fn(data);
+    double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+    allocs += allocations - before;
+    if (r == 0 || seconds < best)
+      best = seconds;
+  }
+
+  result_t result;
+  result.name = name;
+  result.seconds = best;
+  result.mpixels = pixels / best / 1e6;
+  result.runs = runs / best;
+  result.objects = objects / best;
+  result.allocations = static_cast<double>(allocs) / reps;
+  results.push_back(result);
+
+  std::cout << name << ": " << best * 1e3 << " ms";
+  if (pixels)
+    std::cout << "; " << result.mpixels << " Mpixel/s";
+  if (runs)
+    std::cout << "; " << result.runs << " runs/s";
+  if (objects)
+    std::cout << "; " << result.objects << " objects/s";
+  std::cout << "; " << result.allocations << " allocs\n";
+}
+
+static std::string
+json_string(const std::string &s)
+{
+  std::string quoted = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '"' || s[i] == '\\')
+      quoted += '\\';
+    quoted += s[i];
+  }
+  return quoted + "\"";
+}
+
+static void
+write_json(const char *filename)
+{
+  std::ofstream out(filename);
+  out << "{\n  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); ++i) {
+    const result_t &r = results[i];
+    out << "    {\"name\": " << json_string(r.name)
+        << ", \"seconds\": " << r.seconds
+        << ", \"mpixels_per_s\": " << r.mpixels
+        << ", \"runs_per_s\": " << r.runs
+        << ", \"objects_per_s\": " << r.objects
+        << ", \"allocations\": " << r.allocations
+        << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n}\n";
+}
+
+// Synthetic pages.  Each is seeded, so every run and every commit sees
+// the same pixels.
+
+// Quantized pages are mostly long runs of background with short runs of
+// ink, so these vary how often the color changes.
+static cv::Mat
+synthetic_page(int rows, int cols, int mean_run)
+{
+  cv::Mat img(rows, cols, CV_8UC1);
+  std::srand(mean_run);
+  for (int y = 0; y < rows; ++y) {
+    uchar *row = img.ptr(y);
+    uchar color = 0;
+    for (int x = 0; x < cols; ++x) {
+      if (std::rand() % mean_run == 0)
+        color = (std::rand() % 8) * 32;
+      row[x] = color;
+    }
+  }
+  return img;
+}
+
+// Lines of glyph-sized cells, each with a few dark strokes on a light
+// background, at the given number of channels.
+static cv::Mat
+stroke_page(int rows, int cols, int channels)
+{
+  cv::Mat img(rows, cols, CV_MAKETYPE(CV_8U, channels),
+              cv::Scalar::all(224));
+  std::srand(rows ^ cols);
+  const int cell_h = std::max(rows / 60, 6);
+  const int cell_w = cell_h * 2 / 3;
+  for (int top = cell_h; top + cell_h < rows; top += 2 * cell_h) {
+    for (int left = cell_w; left + cell_w < cols; left += cell_w + 2) {
+      if (std::rand() % 6 == 0)
+        continue;
+      int strokes = 1 + std::rand() % 3;
+      for (int s = 0; s < strokes; ++s) {
+        cv::Rect stroke;
+        if (std::rand() % 2) {
+          stroke.width = std::max(cell_w / 5, 1);
+          stroke.height = cell_h / 2 + std::rand() % (cell_h / 2);
+        } else {
+          stroke.width = cell_w / 2 + std::rand() % (cell_w / 2);
+          stroke.height = std::max(cell_h / 8, 1);
+        }
+        stroke.x = left + std::rand() % (cell_w - stroke.width + 1);
+        stroke.y = top + std::rand() % (cell_h - stroke.height + 1);
+        cv::Mat(img, stroke).setTo(cv::Scalar::all(32));
+      }
+    }
+  }
+  return img;
+}
+
+// One-pixel teeth joined along the bottom row: every row is all runs,
+// and none of the teeth joins the others until the last row.
+static cv::Mat
+comb_page(int rows, int cols)
+{
+  cv::Mat img(rows, cols, CV_8UC1);
+  for (int y = 0; y < rows; ++y) {
+    uchar *row = img.ptr(y);
+    for (int x = 0; x < cols; ++x)
+      row[x] = (y == rows - 1 || x % 2 == 0) ? 0 : 255;
+  }
+  return img;
+}
+
+static cv::Mat
+quantized_page(const std::string &filename)
+{
+  cv::Mat gray = cv::imread(filename, 0);
+  for (int y = 0; y < gray.rows; ++y) {
+    uchar *row = gray.ptr(y);
+    for (int x = 0; x < gray.cols; ++x)
+      row[x] = (row[x] / 32) * 32;
+  }
+  return gray;
+}
+
+static size_t
+count_runs(const ObjectSet &objs)
+{
+  return objs.wide ? objs.wide_runs.size() : objs.short_runs.size();
+}
+
+static const char *scanner_names[] = { "scalar", "sse2", "avx2" };
+static const int nscanners = 3;
+
+struct scan_data_t {
+  row_scanner_t scan_row;
+  const cv::Mat *img;
+  std::vector<int> ends;
+  int sink;
+};
+
+static void
+run_scanner(void *ptr)
+{
+  scan_data_t *data = static_cast<scan_data_t *>(ptr);
+  const cv::Mat &img = *data->img;
+  for (int y = 0; y < img.rows; ++y)
+    data->sink += data->scan_row(img.ptr(y), img.cols, &data->ends[0]);
+}
+
+static void
+bench_row_scanners(const std::string &name, const cv::Mat &img)
+{
+  scan_data_t data;
+  data.img = &img;
+  data.ends.resize(img.cols);
+  data.sink = 0;
+  for (int i = 0; i < nscanners; ++i) {
+    data.scan_row = find_row_scanner(scanner_names[i]);
+    if (! data.scan_row)
+      continue;
+    bench("scan_row/" + name + "/" + scanner_names[i], run_scanner, &data,
+          20, static_cast<double>(img.rows) * img.cols, 0., 0.);
+  }
+}
+
+typedef void (*labeler_t)(const cv::Mat &, ObjectSet &);
+
+static void
+label_gray(const cv::Mat &img, ObjectSet &objs)
+{
+  objfind(img, objs);
+}
+
+static void
+label_gray8(const cv::Mat &img, ObjectSet &objs)
+{
+  objfind_with<8, Gray8>(img, objs, SameColor());
+}
+
+static void
+label_bgr(const cv::Mat &img, ObjectSet &objs)
+{
+  objfind_with<4, Bgr8>(img, objs, SameColor());
+}
+
+static void
+label_bgr_near(const cv::Mat &img, ObjectSet &objs)
+{
+  objfind_with<4, Bgr8>(img, objs, NearColor(8));
+}
+
+// Drops specks, which are most of the objects on a noisy page.
+static void
+label_without_specks(const cv::Mat &img, ObjectSet &objs)
+{
+  ObjFilter filter;
+  filter.min_area = 4;
+  objfind(img, objs, filter);
+}
+
+static void
+label_largest(const cv::Mat &img, ObjectSet &objs)
+{
+  ObjFilter filter;
+  filter.top_k = 100;
+  objfind(img, objs, filter);
+}
+
+static void
+label_with_moments(const cv::Mat &img, ObjectSet &objs)
+{
+  objs.track_moments = true;
+  objfind(img, objs);
+}
+
+struct objfind_data_t {
+  labeler_t label;
+  const cv::Mat *img;
+  ObjectSet objs;
+};
+
+static void
+run_objfind(void *ptr)
+{
+  objfind_data_t *data = static_cast<objfind_data_t *>(ptr);
+  data->objs.clear();
+  data->label(*data->img, data->objs);
+}
+
+static void
+bench_objfind(const std::string &name, const cv::Mat &img,
+              labeler_t label = label_gray)
+{
+  objfind_data_t data;
+  data.label = label;
+  data.img = &img;
+  run_objfind(&data);
+  bench("objfind/" + name, run_objfind, &data, 5,
+        static_cast<double>(img.rows) * img.cols,
+        count_runs(data.objs), data.objs.size());
+}
+
+struct sorted_objects_data_t {
+  const cv::Mat *img;
+  std::vector<double> params;
+  Preprocessor prep;
+  ObjectSet objs;
+};
+
+static void
+run_sorted_objects(void *ptr)
+{
+  sorted_objects_data_t *data = static_cast<sorted_objects_data_t *>(ptr);
+  data->objs.clear();
+  get_sorted_objects_from_image(data->prep, *data->img, data->objs,
+                                data->params);
+}
+
+// Letter-sized pages at screen, 150 and 300 dpi.
+static void
+bench_sorted_objects()
+{
+  static const int sizes[][2] = { { 480, 640 }, { 1650, 1275 },
+                                  { 3300, 2550 } };
+  for (int i = 0; i < 3; ++i) {
+    cv::Mat img = stroke_page(sizes[i][0], sizes[i][1], 3);
+    sorted_objects_data_t data;
+    data.img = &img;
+    data.params.push_back(8);
+    run_sorted_objects(&data);
+
+    std::stringstream name;
+    name << "get_sorted_objects/" << img.cols << "x" << img.rows;
+    bench(name.str(), run_sorted_objects, &data, 3,
+          static_cast<double>(img.rows) * img.cols,
+          count_runs(data.objs), data.objs.size());
+  }
+}
+
+// Each run sorts its own unsorted copy, made beforehand.
+struct sort_data_t {
+  std::vector<ObjectSet> copies;
+  size_t next;
+};
+
+static void
+run_sortobjs(void *ptr)
+{
+  sort_data_t *data = static_cast<sort_data_t *>(ptr);
+  sortobjs(data->copies[data->next++]);
+}
+
+static void
+bench_sortobjs()
+{
+  cv::Mat img = stroke_page(3300, 2550, 1);
+  ObjectSet objs;
+  objfind(img, objs);
+
+  const int reps = 5;
+  sort_data_t data;
+  data.copies.assign(reps, objs);
+  data.next = 0;
+  bench("sortobjs", run_sortobjs, &data, reps, 0., 0., objs.size());
+}
+
+struct morph_data_t {
+  const ObjectSet *objs;
+  Obj obj;
+};
+
+// Closes then fills every object of the page, straight from its runs.
+static void
+run_morph(void *ptr)
+{
+  morph_data_t *data = static_cast<morph_data_t *>(ptr);
+  for (size_t i = 0; i < data->objs->size(); ++i) {
+    closeobj((*data->objs)[i], 3, 3, data->obj);
+    fillholes(data->obj, data->obj);
+  }
+}
+
+static void
+bench_morph()
+{
+  cv::Mat img = stroke_page(1000, 2480, 1);
+  ObjectSet objs;
+  objfind(img, objs);
+
+  morph_data_t data;
+  data.objs = &objs;
+  run_morph(&data);
+  bench("closeobj+fillholes/strokes", run_morph, &data, 5, 0.,
+        count_runs(objs), objs.size());
+}
+
+// Objects in lines of text, with only their bounds filled in, which is
+// all the features look at.  If speckled, every other object is instead
+// a speck of noise of one to three pixels anywhere in the line, as in a
+// dirty scan.
+static void
+synthetic_objects(size_t count, bool speckled, ObjectSet &objs)
+{
+  std::srand(count);
+  int x = 0;
+  int y = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Obj obj;
+    if (speckled && i % 2 == 1) {
+      obj.bound.width = 1 + std::rand() % 3;
+      obj.bound.height = 1 + std::rand() % 3;
+      obj.bound.x = std::rand() % 2000;
+      obj.bound.y = y + std::rand() % 30;
+      obj.area = obj.bound.width * obj.bound.height;
+      obj.color = 0;
+      Run run;
+      run.row = obj.bound.y;
+      run.start = obj.bound.x;
+      run.end = obj.bound.x + obj.bound.width;
+      run.flags = 0;
+      obj.runs.push_back(run);
+      objs.push_back(obj);
+      continue;
+    }
+    obj.bound.width = 4 + std::rand() % 12;
+    obj.bound.height = 8 + std::rand() % 16;
+    obj.bound.x = x;
+    obj.bound.y = y + 24 - obj.bound.height - std::rand() % 3;
+    obj.area = obj.bound.width * obj.bound.height / 2;
+    obj.color = 0;
+    Run run;
+    run.row = obj.bound.y;
+    run.start = obj.bound.x;
+    run.end = obj.bound.x + obj.bound.width;
+    run.flags = 0;
+    obj.runs.push_back(run);
+    objs.push_back(obj);
+
+    x += obj.bound.width + 2;
+    if (2000 < x) {
+      x = 0;
+      y += 32;
+    }
+  }
+}
+
+struct feature_data_t {
+  Feature *feature;
+  const ObjectSet *objs;
+  std::vector<double> column;
+};
+
+static void
+run_feature(void *ptr)
+{
+  feature_data_t *data = static_cast<feature_data_t *>(ptr);
+  data->feature->begin_image(*data->objs);
+  data->feature->describe_all(*data->objs, &data->column[0]);
+}
+
+static void
+bench_features()
+{
+  std::vector<Feature *> features;
+  features.push_back(new AspectRatioFeature());
+  features.push_back(new TopPositionFeature());
+  features.push_back(new BottomPositionFeature());
+  features.push_back(new TopPositionFeature(0.01));
+
+  // Pruning pays off on small objects, so the speckled page is where
+  // TopPosition(0.01) should pull well ahead of TopPosition.
+  static const size_t counts[] = { 100, 1000, 10000, 10000 };
+  for (int c = 0; c < 4; ++c) {
+    bool speckled = c == 3;
+    ObjectSet objs;
+    synthetic_objects(counts[c], speckled, objs);
+    for (size_t f = 0; f < features.size(); ++f) {
+      feature_data_t data;
+      data.feature = features[f];
+      data.objs = &objs;
+      data.column.resize(objs.size());
+
+      std::stringstream name;
+      name << "describe/" << features[f]->name();
+      if (f == 3)
+        name << "(0.01)";
+      name << "/" << counts[c];
+      if (speckled)
+        name << "/speckled";
+      bench(name.str(), run_feature, &data, 3, 0., 0., objs.size());
+    }
+  }
+
+  for (size_t f = 0; f < features.size(); ++f)
+    delete features[f];
+}
+
+// Usage: bench [--json FILE] [IMAGE...]
+// Images given are quantized and added to the row scanner and objfind
+// benchmarks.
+int
+main(int argc, char **argv)
+{
+  const char *json = 0;
+  std::vector<std::string> images;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+      json = argv[++i];
+    else
+      images.push_back(argv[i]);
+  }
+
+  cv::Mat noise = synthetic_page(1000, 2480, 2);
+  cv::Mat text = synthetic_page(1000, 2480, 40);
+  cv::Mat solid = synthetic_page(1000, 2480, 5000);
+  cv::Mat strokes = stroke_page(1000, 2480, 1);
+  cv::Mat comb = comb_page(1000, 2480);
+
+  bench_row_scanners("noise", noise);
+  bench_row_scanners("text", text);
+  bench_row_scanners("solid", solid);
+  for (size_t i = 0; i < images.size(); ++i)
+    bench_row_scanners(images[i], quantized_page(images[i]));
+
+  bench_objfind("noise", noise);
+  bench_objfind("strokes", strokes);
+  bench_objfind("solid", solid);
+  bench_objfind("comb", comb);
+  bench_objfind("noise/no-specks", noise, label_without_specks);
+  bench_objfind("noise/top-100", noise, label_largest);
+  bench_objfind("strokes/moments", strokes, label_with_moments);
+  bench_objfind("strokes/8-connected", strokes, label_gray8);
+  cv::Mat color_strokes = stroke_page(1000, 2480, 3);
+  bench_objfind("strokes/bgr", color_strokes, label_bgr);
+  bench_objfind("strokes/bgr-near", color_strokes, label_bgr_near);
+  for (size_t i = 0; i < images.size(); ++i)
+    bench_objfind(images[i], quantized_page(images[i]));
+
+  bench_sorted_objects();
+  bench_sortobjs();
+  bench_morph();
+  bench_features();
+
+  if (json)
+    write_json(json);
+  return 0;
+}
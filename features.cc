@@ -1,10 +1,11 @@
-#include <cassert>
+#include <algorithm>
 #include <map>
-#include <set>
-#include <sstream>
 #include <string>
 #include <vector>
 
+#include <pthread.h>
+#include <unistd.h>
+
 #include <boost/lexical_cast.hpp>
 
 #define CV_NO_BACKWARD_COMPATIBILITY
@@ -13,182 +14,258 @@
 
 #include "features.h"
 #include "image.h"
+#include "imageload.h"
+#include "instrument.h"
+#include "labels.h"
+#include "objcache.h"
+#include "pipeline.h"
 #include "sql.h"
+#include "stats.h"
 
-const std::ios_base::openmode SS_BUFFER_MODE =
-  std::stringstream::ate | std::stringstream::out;
+typedef std::map<int, FeatureStats> char_result_map_t;
 
-typedef void (*table_processor_t)(const std::string &, void *);
+// Results are summarized as they come in, and each labeling's summaries
+// are folded into the totals as soon as the labelings before it are, so
+// memory doesn't grow with the corpus.
+struct FeatureData {
+  Feature *feature;
+  StatsOptions options;
+  char_result_map_t char_results;
+  FeatureStats junk_results;
+  double error;
 
-struct callback_data_t {
-  table_processor_t proc;
-  void *proc_data;
+  FeatureData(Feature *f, const StatsOptions &opts)
+    : feature(f), options(opts), junk_results(opts), error(0.)
+  { }
+
+  FeatureStats &char_stats(int c)
+  {
+    char_result_map_t::iterator iter = char_results.find(c);
+    if (iter == char_results.end()) {
+      FeatureStats stats(options);
+      iter = char_results.insert(std::make_pair(c, stats)).first;
+    }
+    return iter->second;
+  }
 };
 
-static int
-for_each_table_callback(void *ptr, int ncolumns, char **text, char **names)
+static void
+add_features(std::vector<FeatureData> &features)
 {
-  callback_data_t *data = static_cast<callback_data_t *>(ptr);
-  std::string name(text[0]);
-  data->proc(name, data->proc_data);
-  return 0;
+  StatsOptions options;
+  options.sketch_k = 128;
+  features.push_back(FeatureData(new AspectRatioFeature(), options));
+  options.nbins = 50;
+  options.lo = 0.;
+  options.hi = 1.;
+  features.push_back(FeatureData(new TopPositionFeature(), options));
+  features.push_back(FeatureData(new BottomPositionFeature(), options));
 }
 
+// Merging tables in the same order always gives the same summaries.
 static void
-for_each_table(sqlite3 *db, table_processor_t proc, void *proc_data)
+merge_feature_data(FeatureData &into, const FeatureData &from)
 {
-  const char *stmt = "SELECT name FROM sqlite_master WHERE type='table'";
-  callback_data_t data;
-  data.proc = proc;
-  data.proc_data = proc_data;
-  SQL_OK(sqlite3_exec(db, stmt, for_each_table_callback, &data, 0));
+  char_result_map_t::const_iterator iter;
+  for (iter = from.char_results.begin(); iter != from.char_results.end();
+       ++iter)
+    into.char_stats(iter->first).merge(iter->second);
+  into.junk_results.merge(from.junk_results);
+  into.error = std::max(into.error, from.error);
 }
 
-static std::string
-deconstruct_table_name(const std::string &table_name,
-                       std::vector<double> &params)
-{
-  size_t plus_index = table_name.find_last_of('+');
-  assert(plus_index != std::string::npos);
-  std::string filename = table_name.substr(0, plus_index);
-
-  size_t end_num;
-  // Expect at least one parameter
-  size_t start_num = plus_index + 1;
-  do {
-    end_num = table_name.find(',', start_num);
-    std::string num_str = table_name.substr(start_num, end_num);
-    double num = boost::lexical_cast<double>(num_str);
-    params.push_back(num);
-    start_num = end_num + 1;
-  } while (end_num != std::string::npos);
-
-  return filename;
-}
+// Each feature thread has its own connection and Feature instances,
+// since features may keep state between objects.
+struct worker_data_t {
+  sqlite3 *db;
+  std::vector<FeatureData> features;
+};
 
-struct obj_desc_t {
-  int x, y, c;
+// Labelings' results, folded into totals in labeling order.  Results
+// that finish ahead of an earlier labeling wait in pending until it's
+// merged, so only the labelings the threads have run ahead with are
+// kept, never the whole corpus.
+struct ordered_merge_t {
+  std::vector<FeatureData> *totals;
+  std::map<size_t, std::vector<FeatureData> > pending;
+  size_t next;
+  pthread_mutex_t lock;
 };
 
-static bool operator <(const obj_desc_t &o1, const obj_desc_t &o2)
-{
-  return o1.y < o2.y || (o1.y == o2.y && o1.x < o2.x);
-}
+struct feature_stage_t {
+  const std::vector<labeling_t> *labelings;
+  ordered_merge_t *merge;
+  std::vector<worker_data_t> workers;
+};
 
-typedef std::set<obj_desc_t> obj_desc_set_t;
+static const int JUNK = -1;
 
-static int
-load_descriptors_callback(void *ptr, int ncolumns, char **text, char **names)
+// Each object's character, or JUNK if it wasn't labeled.  Each object is
+// looked up once per image, by binary search in the labels as they come
+// sorted from the database.
+static void
+match_descriptors(const std::vector<label_t> &descriptors, objs_t &objs,
+                  std::vector<int> &labels)
 {
-  obj_desc_set_t *descriptors = static_cast<obj_desc_set_t *>(ptr);
-  assert(ncolumns == 3);
-  obj_desc_t desc;
-  desc.x = boost::lexical_cast<int>(text[0]);
-  desc.y = boost::lexical_cast<int>(text[1]);
-  desc.c = boost::lexical_cast<int>(text[2]);
-  descriptors->insert(desc);
-  return 0;
+  labels.resize(objs.size());
+  for (size_t i = 0; i < objs.size(); ++i) {
+    Run first = objs.run(objs.offsets[i]);
+    const label_t *label = find_label(descriptors, first.start, first.row);
+    labels[i] = label ? label->c : JUNK;
+  }
 }
 
 static void
-load_object_descriptors(const std::string &table_name,
-                        sqlite3 *db,
-                        obj_desc_set_t &descriptors)
+record_results(FeatureData &data, const std::vector<int> &labels,
+               const std::vector<double> &matrix, size_t column)
 {
-  std::stringstream buffer(
-    "SELECT x, y, char FROM '",
-    SS_BUFFER_MODE
-    );
-  buffer << table_name << "';";
-  std::string stmt_str = buffer.str();
-  const char *stmt = stmt_str.c_str();
-
-  SQL_OK(sqlite3_exec(db, stmt, load_descriptors_callback, &descriptors, 0));
+  for (size_t i = 0; i < labels.size(); ++i) {
+    double result = matrix[column + i];
+    if (labels[i] == JUNK)
+      data.junk_results.add(result);
+    else
+      data.char_stats(labels[i]).add(result);
+  }
 }
 
-typedef std::map<int, std::vector<double> > char_result_map_t;
-
-struct FeatureData {
-  Feature *feature;
-  char_result_map_t char_results;
-  std::vector<double> junk_results;
+static void
+process_table(const labeling_t &labeling, objs_t &objs, worker_data_t *data,
+              std::vector<FeatureData> &results)
+{
+  std::vector<int> labels;
+  {
+    StageTimer timer("labels");
+    std::vector<label_t> descriptors;
+    load_labels(data->db, labeling.image_id, labeling.params_id,
+                descriptors);
+    match_descriptors(descriptors, objs, labels);
+  }
 
-  FeatureData(Feature *f)
-    : feature(f)
-  { }
-};
+  std::vector<Feature *> features;
+  for (size_t f = 0; f < data->features.size(); ++f)
+    features.push_back(data->features[f].feature);
+  std::vector<double> matrix;
+  describe_objects(features, objs, matrix);
 
-struct process_data_t {
-  sqlite3 *db;
-  std::vector<FeatureData> features;
-};
+  results = data->features;
+  for (size_t f = 0; f < results.size(); ++f) {
+    record_results(results[f], labels, matrix, f * objs.size());
+    results[f].error = features[f]->error_bound();
+  }
+}
 
+// Takes labeling index's results, and merges every labeling that's now
+// next in order, freeing their results.
 static void
-run_feature(FeatureData &data, const obj_desc_set_t &descriptors,
-            objs_t &objs, size_t subject)
+merge_in_order(ordered_merge_t *merge, size_t index,
+               std::vector<FeatureData> &results)
 {
-  double result = data.feature->describe(objs, subject);
-
-  const Obj &obj = objs[subject];
-  obj_desc_t key;
-  key.x = obj.runs[0].start;
-  key.y = obj.runs[0].row;
-  obj_desc_set_t::iterator desc_iter = descriptors.find(key);
-
-  if (desc_iter == descriptors.end())
-    data.junk_results.push_back(result);
-  else {
-    int c = desc_iter->c;
-    data.char_results[c].push_back(result);
+  pthread_mutex_lock(&merge->lock);
+  merge->pending[index].swap(results);
+  std::map<size_t, std::vector<FeatureData> >::iterator iter;
+  while (! merge->pending.empty() &&
+         (iter = merge->pending.begin())->first == merge->next) {
+    for (size_t f = 0; f < iter->second.size(); ++f)
+      merge_feature_data((*merge->totals)[f], iter->second[f]);
+    merge->pending.erase(iter);
+    ++merge->next;
   }
+  pthread_mutex_unlock(&merge->lock);
 }
 
-static void
-process_table(const std::string &name, void *ptr)
+// The last stage of the pipeline.  A job holds the labelings
+// job->index onwards, one per set of params.
+static void *
+describe_job(void *item, void *stage_data, int worker)
 {
-  process_data_t *data = static_cast<process_data_t *>(ptr);
-  std::vector<double> params;
-  std::string filename = deconstruct_table_name(name, params);
-
-  obj_desc_set_t descriptors;
-  load_object_descriptors(name, data->db, descriptors);
-
-  cv::Mat img = cv::imread(filename);
-  std::vector<Obj> objs;
-  get_sorted_objects_from_image(img, objs, params);
-
-  for (size_t f = 0; f < data->features.size(); ++f) {
-    for (size_t j = 0; j < objs.size(); ++j)
-      run_feature(data->features[f], descriptors, objs, j);
+  image_job_t *job = static_cast<image_job_t *>(item);
+  feature_stage_t *stage = static_cast<feature_stage_t *>(stage_data);
+  {
+    ProfileScope scope(&job->profile);
+    for (size_t i = 0; i < job->params.size(); ++i) {
+      size_t index = job->index + i;
+      std::vector<FeatureData> results;
+      process_table((*stage->labelings)[index], job->objs[i],
+                    &stage->workers[worker], results);
+      merge_in_order(stage->merge, index, results);
+    }
   }
+  log_profile(job->filename, job->profile);
+  delete job;
+  return 0;
 }
 
-struct stats_t {
-  double ave, dev;
-};
-
-static stats_t
-calc_stats(const std::vector<double> &x)
+// Images are read, decoded and labeled ahead of the feature threads, in
+// a pipeline where at most depth images wait for each stage.  Labelings
+// come ordered by image, and all of an image's labelings go in one job,
+// so the image is read once however many params it was labeled with.  Each
+// labeling's results are merged in labeling order, so the totals don't
+// depend on the number of threads or on which one finished first.
+static void
+process_all_tables(sqlite3 *db, const char *filename, int nthreads,
+                   size_t depth, int tile_threads, ObjCache &cache,
+                   std::vector<FeatureData> &totals)
 {
-  stats_t stats;
-  double n = x.size();
-
-  stats.ave = 0.;
-  for (size_t i = 0; i < x.size(); ++i)
-    stats.ave += x[i] / n;
-
-  if (n == 1.)
-    stats.dev = -1.;
-  else {
-    stats.dev = 0.;
-    for (size_t i = 0; i < x.size(); ++i) {
-      double xd = x[i] - stats.ave;
-      xd *= xd;
-      stats.dev += xd / (n - 1);
+  std::vector<labeling_t> labelings;
+  load_labelings(db, labelings);
+
+  ordered_merge_t merge;
+  merge.totals = &totals;
+  merge.next = 0;
+  pthread_mutex_init(&merge.lock, 0);
+
+  nthreads = std::max(nthreads, 1);
+  feature_stage_t stage;
+  stage.labelings = &labelings;
+  stage.merge = &merge;
+  stage.workers.resize(nthreads);
+  for (int w = 0; w < nthreads; ++w) {
+    worker_data_t &worker = stage.workers[w];
+    SQL_OK(open_sql_db_and_ensure_close_on_exit(filename, &worker.db));
+    add_features(worker.features);
+  }
+
+  std::vector<void *> jobs;
+  for (size_t i = 0; i < labelings.size(); ++i) {
+    image_job_t *job = 0;
+    if (! jobs.empty()) {
+      job = static_cast<image_job_t *>(jobs.back());
+      if (labelings[i].image_id != labelings[job->index].image_id)
+        job = 0;
+    }
+    if (! job) {
+      job = new image_job_t;
+      job->index = i;
+      job->filename = labelings[i].filename;
+      jobs.push_back(job);
     }
+    job->params.push_back(labelings[i].params);
   }
 
-  return stats;
+  ImageLoader loader(cache, 1, nthreads, nthreads, depth, tile_threads);
+  Pipeline pipeline;
+  loader.add_stages(pipeline);
+  pipeline.add_stage(describe_job, &stage, nthreads, depth);
+  pipeline.start(jobs);
+  pipeline.finish();
+  pthread_mutex_destroy(&merge.lock);
+}
+
+static void
+print_stats(const FeatureStats &stats, const FeatureStats &junk)
+{
+  const RunningStats &moments = stats.moments();
+  std::cout << "average=" << moments.mean() << "; "
+            << "std dev=" << moments.variance();
+  if (stats.sketch())
+    std::cout << "; median=" << stats.sketch()->quantile(0.5);
+  if (&stats != &junk) {
+    std::cout << "; separation=" << separation(moments, junk.moments());
+    if (stats.histogram() && junk.histogram())
+      std::cout << "; overlap="
+                << overlap(*stats.histogram(), *junk.histogram());
+  }
+  std::cout << "\n";
 }
 
 static void
@@ -197,31 +274,51 @@ compile_stats(const std::vector<FeatureData> &data)
   for (size_t i = 0; i < data.size(); ++i) {
     const FeatureData &f = data[i];
     std::cout << f.feature->name() << ":\n";
+    if (f.error != 0.)
+      std::cout << "max error=" << f.error << "\n";
     char_result_map_t::const_iterator iter;
     for (iter = f.char_results.begin(); iter != f.char_results.end(); ++iter) {
       char c = iter->first;
-      stats_t stats = calc_stats(iter->second);
-      std::cout << "'" << c << "': "
-                << "average=" << stats.ave << "; "
-                << "std dev=" << stats.dev << "\n";
+      std::cout << "'" << c << "': ";
+      print_stats(iter->second, f.junk_results);
     }
+    std::cout << "junk: ";
+    print_stats(f.junk_results, f.junk_results);
   }
 }
 
 int
-main()
+main(int argc, char **argv)
 {
+  const char *filename = "objs.sqlite";
   sqlite3 *db;
-  SQL_OK(open_sql_db_and_ensure_close_on_exit("objs.sqlite", &db));
-
-  process_data_t proc_data;
-  proc_data.db = db;
-  proc_data.features.push_back(FeatureData(new AspectRatioFeature()));
-  proc_data.features.push_back(FeatureData(new TopPositionFeature()));
-  proc_data.features.push_back(FeatureData(new BottomPositionFeature()));
-
-  for_each_table(db, process_table, &proc_data);
-  compile_stats(proc_data.features);
+  SQL_OK(open_sql_db_and_ensure_close_on_exit(filename, &db));
+  if (! check_no_legacy_label_tables(db, filename))
+    return 1;
+  ensure_label_schema(db);
+
+  // Optional arguments: number of threads per stage, how many images
+  // may wait for each stage, and how many tiles each image is labeled
+  // on at once.  By default the tiles take up the cores the stages
+  // leave.
+  int ncores = std::max(static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)), 1);
+  int nthreads = ncores;
+  if (1 < argc)
+    nthreads = boost::lexical_cast<int>(argv[1]);
+  size_t depth = std::max(nthreads, 1);
+  if (2 < argc)
+    depth = boost::lexical_cast<size_t>(argv[2]);
+  int tile_threads = std::max(ncores / std::max(nthreads, 1), 1);
+  if (3 < argc)
+    tile_threads = boost::lexical_cast<int>(argv[3]);
+
+  std::vector<FeatureData> totals;
+  add_features(totals);
+
+  ObjCache cache(labeler_signature());
+  process_all_tables(db, filename, nthreads, depth, tile_threads, cache,
+                     totals);
+  compile_stats(totals);
 
   return 0;
 }
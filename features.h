@@ -2,18 +2,31 @@
 #define FEATURES_INCLUDED 1
 
 #include <cmath>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include "instrument.h"
 #include "objfind.h"
 
-typedef const std::vector<Obj> objs_t;
+typedef const ObjectSet objs_t;
 
 class Feature
 {
 public:
   virtual const char *name() = 0;
   virtual double describe(objs_t &, size_t) = 0;
+  // Describes every object in turn, storing the results in column.
+  virtual void describe_all(objs_t &objs, double *column)
+  {
+    for (size_t i = 0; i < objs.size(); ++i)
+      column[i] = describe(objs, i);
+  }
+  // Called with each image's objects before any of them are described.
+  virtual void begin_image(objs_t &) {}
+  // How far any result so far may be from the exact value.
+  virtual double error_bound() { return 0.; }
   virtual ~Feature() {}
 };
 
@@ -23,23 +36,109 @@ public:
   virtual const char *name() { return "AspectRatio"; }
   virtual double describe(objs_t &objs, size_t subject)
   {
-    const Obj &obj = objs[subject];
-    return static_cast<double>(obj.bound.height) / obj.bound.width;
+    const cv::Rect &bound = objs.bounds[subject];
+    return static_cast<double>(bound.height) / bound.width;
+  }
+  virtual void describe_all(objs_t &objs, double *column)
+  {
+    const cv::Rect *bounds = objs.bounds.empty() ? 0 : &objs.bounds[0];
+    for (size_t i = 0; i < objs.size(); ++i)
+      column[i] = static_cast<double>(bounds[i].height) / bounds[i].width;
   }
 };
 
-class TopPositionFeature: public Feature
+// Scores how many other objects are lined up with the subject, weighted
+// by how close they are in size.  The exact score looks at every pair.
+// With epsilon above zero, objects are indexed by height and position so
+// pairs that would add less than epsilon are never looked at; each
+// result is then low by at most epsilon, and error_bound() reports the
+// worst case actually seen.
+class PositionFeature : public Feature
 {
 public:
-  virtual const char *name() { return "TopPosition"; }
+  PositionFeature(bool top, double epsilon);
   virtual double describe(objs_t &objs, size_t subject);
+  virtual void describe_all(objs_t &objs, double *column);
+  virtual void begin_image(objs_t &objs);
+  virtual double error_bound() { return worst_error; }
+
+private:
+  struct Entry {
+    int pos;
+    size_t id;
+  };
+
+  typedef std::map<int, std::vector<Entry> > height_index_t;
+  typedef std::map<int, size_t> count_t;
+  typedef std::map<std::pair<int, int>, size_t> pair_count_t;
+  struct Level {
+    int pos;
+    int width;
+    int height;
+  };
+
+  bool top;
+  double epsilon;
+  double worst_error;
+  size_t pairs_scored;
+  objs_t *indexed;
+  height_index_t by_height;
+  count_t width_counts;
+  count_t height_counts;
+  pair_count_t size_counts;
+  // Every object, by position and height, and by position, width and
+  // height.
+  std::vector<Level> levels;
+  std::vector<Level> level_sizes;
+
+  static bool entry_less(const Entry &e1, const Entry &e2)
+  { return e1.pos < e2.pos; }
+  static bool level_less(const Level &l1, const Level &l2)
+  { return l1.pos < l2.pos || (l1.pos == l2.pos && l1.height < l2.height); }
+  static bool level_size_less(const Level &l1, const Level &l2)
+  {
+    return l1.pos < l2.pos || (l1.pos == l2.pos &&
+                               (l1.width < l2.width ||
+                                (l1.width == l2.width &&
+                                 l1.height < l2.height)));
+  }
+
+  int position(const cv::Rect &bound) const;
+  double describe_exact(objs_t &objs, size_t subject);
+  double describe_pruned(objs_t &objs, size_t subject);
+  size_t count_far_level(int pos, int width, int low, int high) const;
+};
+
+class TopPositionFeature: public PositionFeature
+{
+public:
+  TopPositionFeature(double epsilon = 0.) : PositionFeature(true, epsilon) {}
+  virtual const char *name() { return "TopPosition"; }
 };
 
-class BottomPositionFeature: public Feature
+class BottomPositionFeature: public PositionFeature
 {
 public:
+  BottomPositionFeature(double epsilon = 0.)
+    : PositionFeature(false, epsilon)
+  {}
   virtual const char *name() { return "BottomPosition"; }
-  virtual double describe(objs_t &objs, size_t subject);
 };
 
+// Fills matrix with one column per feature, each holding that feature
+// for every object in order.  begin_image is called for each feature.
+inline void
+describe_objects(const std::vector<Feature *> &features, objs_t &objs,
+                 std::vector<double> &matrix)
+{
+  matrix.resize(features.size() * objs.size());
+  if (matrix.empty())
+    return;
+  for (size_t f = 0; f < features.size(); ++f) {
+    StageTimer timer("feature", features[f]->name());
+    features[f]->begin_image(objs);
+    features[f]->describe_all(objs, &matrix[f * objs.size()]);
+  }
+}
+
 #endif // FEATURES_INCLUDED
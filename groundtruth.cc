@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <fstream>
+
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "groundtruth.h"
+
+static bool
+ends_with(const std::string &s, const std::string &suffix)
+{
+  return suffix.size() <= s.size() &&
+    s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void
+add_box(const cv::Rect &bound, const std::string &text,
+        std::vector<truth_box_t> &boxes, size_t *skipped)
+{
+  if (text.size() != 1 || bound.width <= 0 || bound.height <= 0) {
+    ++*skipped;
+    return;
+  }
+  truth_box_t box;
+  box.bound = bound;
+  box.c = static_cast<unsigned char>(text[0]);
+  boxes.push_back(box);
+}
+
+// A quoted CSV field loses its quotes, and doubled quotes inside it
+// become one.
+static std::string
+unquote(const std::string &field)
+{
+  if (field.size() < 2 || field[0] != '"' || field[field.size() - 1] != '"')
+    return field;
+  std::string text;
+  for (size_t i = 1; i + 1 < field.size(); ++i) {
+    text += field[i];
+    if (field[i] == '"' && field[i + 1] == '"')
+      ++i;
+  }
+  return text;
+}
+
+// The text is everything after the fourth comma, so it may itself be a
+// comma.  A first line that doesn't start with a number is a header.
+static bool
+load_csv(std::istream &in, std::vector<truth_box_t> &boxes, size_t *skipped)
+{
+  std::string line;
+  for (size_t n = 0; std::getline(in, line); ++n) {
+    if (! line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.empty() || line[0] == '#')
+      continue;
+
+    int fields[4];
+    size_t start = 0;
+    bool ok = true;
+    for (int i = 0; i < 4 && ok; ++i) {
+      size_t comma = line.find(',', start);
+      ok = comma != std::string::npos;
+      if (ok) {
+        try {
+          fields[i] = boost::lexical_cast<int>(line.substr(start,
+                                                           comma - start));
+        } catch (boost::bad_lexical_cast &) {
+          ok = false;
+        }
+        start = comma + 1;
+      }
+    }
+    if (! ok) {
+      if (n == 0)
+        continue;
+      return false;
+    }
+    add_box(cv::Rect(fields[0], fields[1], fields[2], fields[3]),
+            unquote(line.substr(start)), boxes, skipped);
+  }
+  return true;
+}
+
+template<typename T>
+static T
+get_either(const boost::property_tree::ptree &tree, const char *name,
+           const char *alias)
+{
+  boost::optional<T> value = tree.get_optional<T>(name);
+  return value ? *value : tree.get<T>(alias);
+}
+
+// The boxes may also be under a "boxes" key of a top-level object.
+static bool
+load_json(std::istream &in, std::vector<truth_box_t> &boxes, size_t *skipped)
+{
+  using boost::property_tree::ptree;
+  try {
+    ptree root;
+    boost::property_tree::read_json(in, root);
+    const ptree &list = root.get_child("boxes", root);
+    BOOST_FOREACH(const ptree::value_type &item, list) {
+      const ptree &box = item.second;
+      cv::Rect bound(box.get<int>("x"), box.get<int>("y"),
+                     get_either<int>(box, "width", "w"),
+                     get_either<int>(box, "height", "h"));
+      add_box(bound, get_either<std::string>(box, "text", "char"),
+              boxes, skipped);
+    }
+  } catch (boost::property_tree::ptree_error &) {
+    return false;
+  }
+  return true;
+}
+
+bool
+load_ground_truth(const std::string &filename,
+                  std::vector<truth_box_t> &boxes, size_t *skipped)
+{
+  std::ifstream in(filename.c_str());
+  if (! in)
+    return false;
+  if (ends_with(filename, ".json"))
+    return load_json(in, boxes, skipped);
+  return load_csv(in, boxes, skipped);
+}
+
+BoxIndex::BoxIndex(const std::vector<truth_box_t> &boxes, int cell)
+  : boxes(&boxes), cell(cell), left(0), top(0), cols(0), rows(0)
+{
+  if (! boxes.empty()) {
+    cv::Rect all = boxes[0].bound;
+    for (size_t i = 1; i < boxes.size(); ++i)
+      all |= boxes[i].bound;
+    left = all.x;
+    top = all.y;
+    cols = (all.width + cell - 1) / cell;
+    rows = (all.height + cell - 1) / cell;
+  }
+
+  // Counted first, then filled, so the buckets are one flat array.
+  std::vector<size_t> counts(cols * rows + 1, 0);
+  int x0, y0, x1, y1;
+  for (int pass = 0; pass < 2; ++pass) {
+    if (pass == 1) {
+      offsets.resize(counts.size());
+      size_t total = 0;
+      for (size_t c = 0; c < counts.size(); ++c) {
+        offsets[c] = total;
+        total += counts[c];
+        counts[c] = offsets[c];
+      }
+      cells.resize(total);
+    }
+    for (size_t i = 0; i < boxes.size(); ++i) {
+      if (! cell_range(boxes[i].bound, x0, y0, x1, y1))
+        continue;
+      for (int y = y0; y <= y1; ++y) {
+        for (int x = x0; x <= x1; ++x) {
+          size_t &count = counts[y * cols + x];
+          if (pass == 1)
+            cells[count] = i;
+          ++count;
+        }
+      }
+    }
+  }
+}
+
+// The cells bound touches, clipped to the grid.  False if it misses the
+// grid altogether.
+bool
+BoxIndex::cell_range(const cv::Rect &bound, int &x0, int &y0,
+                     int &x1, int &y1) const
+{
+  int x = bound.x - left;
+  int y = bound.y - top;
+  if (bound.width <= 0 || bound.height <= 0 ||
+      x + bound.width <= 0 || y + bound.height <= 0)
+    return false;
+  x0 = std::max(x, 0) / cell;
+  y0 = std::max(y, 0) / cell;
+  x1 = std::min((x + bound.width - 1) / cell, cols - 1);
+  y1 = std::min((y + bound.height - 1) / cell, rows - 1);
+  return x0 <= x1 && y0 <= y1;
+}
+
+namespace {
+  struct box_pair_t {
+    double iou;
+    size_t bound;
+    size_t box;
+
+    // Best first, ties going to the earlier bound, then the earlier box.
+    bool operator<(const box_pair_t &other) const {
+      if (iou != other.iou)
+        return other.iou < iou;
+      if (bound != other.bound)
+        return bound < other.bound;
+      return box < other.box;
+    }
+  };
+}
+
+size_t
+BoxIndex::match(const std::vector<cv::Rect> &bounds, double min_overlap,
+                std::vector<const truth_box_t *> &matches) const
+{
+  std::vector<box_pair_t> pairs;
+  std::vector<size_t> near;
+  int x0, y0, x1, y1;
+  for (size_t b = 0; b < bounds.size(); ++b) {
+    const cv::Rect &bound = bounds[b];
+    if (! cell_range(bound, x0, y0, x1, y1))
+      continue;
+    // Boxes in several cells are seen more than once.
+    near.clear();
+    for (int y = y0; y <= y1; ++y) {
+      size_t c = y * cols;
+      near.insert(near.end(), cells.begin() + offsets[c + x0],
+                  cells.begin() + offsets[c + x1 + 1]);
+    }
+    std::sort(near.begin(), near.end());
+    near.erase(std::unique(near.begin(), near.end()), near.end());
+
+    double bound_area = static_cast<double>(bound.width) * bound.height;
+    for (size_t i = 0; i < near.size(); ++i) {
+      const cv::Rect &box = (*boxes)[near[i]].bound;
+      cv::Rect overlap = box & bound;
+      double area = static_cast<double>(overlap.width) * overlap.height;
+      if (area <= 0. || area < min_overlap * bound_area)
+        continue;
+      box_pair_t pair;
+      pair.iou = area / (bound_area +
+                         static_cast<double>(box.width) * box.height - area);
+      pair.bound = b;
+      pair.box = near[i];
+      pairs.push_back(pair);
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+
+  matches.assign(bounds.size(), 0);
+  std::vector<bool> taken(boxes->size(), false);
+  size_t unmatched = boxes->size();
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    const box_pair_t &pair = pairs[i];
+    if (matches[pair.bound] || taken[pair.box])
+      continue;
+    matches[pair.bound] = &(*boxes)[pair.box];
+    taken[pair.box] = true;
+    --unmatched;
+  }
+  return unmatched;
+}
@@ -0,0 +1,59 @@
+#ifndef GROUNDTRUTH_INCLUDED
+#define GROUNDTRUTH_INCLUDED 1
+
+#include <string>
+#include <vector>
+
+#define CV_NO_BACKWARD_COMPATIBILITY
+#include <opencv/cv.h>
+
+// Character boxes for an image from some other source, such as another
+// OCR pipeline, for labeling objects without showing them.
+struct truth_box_t {
+  cv::Rect bound;
+  int c;
+};
+
+// Reads boxes from a .json file, as an array of objects with x, y,
+// width (or w), height (or h) and text (or char), or from any other file
+// as CSV lines of x,y,width,height,text.  Only one-character texts are
+// kept; *skipped counts the rest.  Returns false if the file can't be
+// read or parsed.
+extern bool
+load_ground_truth(const std::string &filename,
+                  std::vector<truth_box_t> &boxes, size_t *skipped);
+
+// Boxes bucketed on a grid of cell-sized squares, so finding the boxes
+// near an object looks at a few cells rather than every box.
+class BoxIndex
+{
+public:
+  explicit BoxIndex(const std::vector<truth_box_t> &boxes, int cell = 32);
+
+  // Pairs each of bounds with at most one box and each box with at most
+  // one bound.  A pair needs at least min_overlap of the bound's area to
+  // lie in the box, and pairs with the highest intersection over union
+  // are taken first, so a box goes to its character rather than to a
+  // counter or a speck inside it.  matches[i] is bounds[i]'s box, or 0.
+  // Returns the number of boxes left without a bound.
+  size_t match(const std::vector<cv::Rect> &bounds, double min_overlap,
+               std::vector<const truth_box_t *> &matches) const;
+
+private:
+  const std::vector<truth_box_t> *boxes;
+  int cell;
+  // The grid's top left corner, and its size in cells.
+  int left;
+  int top;
+  int cols;
+  int rows;
+  // Box indices by cell, cell (x, y) being cells[offsets[y * cols + x]]
+  // up to the next cell's offset.
+  std::vector<size_t> offsets;
+  std::vector<size_t> cells;
+
+  bool cell_range(const cv::Rect &bound, int &x0, int &y0,
+                  int &x1, int &y1) const;
+};
+
+#endif  // GROUNDTRUTH_INCLUDED
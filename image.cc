@@ -1,10 +1,21 @@
+#include <algorithm>
+#include <cassert>
+#include <sstream>
+
 #include "image.h"
+#include "instrument.h"
+
+// The number of colors sets the step between quantized gray levels.
+static int
+color_step(int ncolors)
+{
+  return static_cast<uchar>(256 / ncolors);
+}
 
 static void
-trunc_colors(cv::Mat &m, int ncolors)
+build_histogram(const cv::Mat &m, int *hist)
 {
   assert(m.type() == CV_8UC1);
-  uchar n = 256 / ncolors;
 
   cv::Size size = m.size();
   if (m.isContinuous()) {
@@ -12,26 +23,202 @@ trunc_colors(cv::Mat &m, int ncolors)
     size.height = 1;
   }
 
+  std::fill(hist, hist + 256, 0);
   for (int i = 0; i < size.height; ++i) {
-    uchar *p = m.ptr(i);
-    for (int j = 0; j < size.width; ++j) {
-      p[j] = (p[j] / n) * n;
+    const uchar *p = m.ptr(i);
+    for (int j = 0; j < size.width; ++j)
+      ++hist[p[j]];
+  }
+}
+
+// Equalization followed by truncating to ncolors is one table lookup per
+// pixel.  The equalization table is the one equalizeHist builds from the
+// histogram.
+static void
+build_color_table(const int *hist, int npixels, int ncolors, uchar *table)
+{
+  int n = color_step(ncolors);
+
+  float scale = 255.f / npixels;
+  int sum = 0;
+  for (int i = 0; i < 256; ++i) {
+    sum += hist[i];
+    int val = cvRound(sum * scale);
+    uchar equalized = (i == 0) ? 0 : cv::saturate_cast<uchar>(val);
+    table[i] = (equalized / n) * n;
+  }
+}
+
+static void
+apply_color_table(const cv::Mat &src, cv::Mat &dst, const uchar *table)
+{
+  dst.create(src.size(), src.type());
+  cv::Size size = src.size();
+  if (src.isContinuous() && dst.isContinuous()) {
+    size.width *= size.height;
+    size.height = 1;
+  }
+
+  for (int i = 0; i < size.height; ++i) {
+    const uchar *p = src.ptr(i);
+    uchar *q = dst.ptr(i);
+    for (int j = 0; j < size.width; ++j)
+      q[j] = table[p[j]];
+  }
+}
+
+void
+Preprocessor::prepare(const cv::Mat &img)
+{
+  {
+    StageTimer timer("pyramid");
+    cv::pyrDown(img, pyrd);
+    if (img.channels() == 1)
+      cv::pyrUp(pyrd, gray);
+    else {
+      cv::pyrUp(pyrd, pyru);
+      cv::cvtColor(pyru, gray, CV_BGR2GRAY);
     }
+    profile_bytes("pyramid", pyrd.step * pyrd.rows + pyru.step * pyru.rows +
+                  gray.step * gray.rows);
   }
+
+  StageTimer timer("quantize");
+  build_histogram(gray, hist);
+}
+
+const cv::Mat &
+Preprocessor::quantize(int ncolors)
+{
+  StageTimer timer("quantize");
+  uchar table[256];
+  build_color_table(hist, gray.rows * gray.cols, ncolors, table);
+  apply_color_table(gray, quantized, table);
+  return quantized;
+}
+
+const cv::Mat &
+Preprocessor::run(const cv::Mat &img, const std::vector<double> &params)
+{
+  prepare(img);
+  return quantize(params[0]);
+}
+
+void
+get_sorted_objects_from_image(Preprocessor &prep,
+                              const cv::Mat &img,
+                              ObjectSet &objs,
+                              const std::vector<double> &params,
+                              int nthreads,
+                              const ObjFilter &filter)
+{
+  const cv::Mat &final = prep.run(img, params);
+  objfind_parallel(final, objs, nthreads, filter);
+  StageTimer timer("sort");
+  sortobjs(objs);
 }
 
 void
 get_sorted_objects_from_image(const cv::Mat &img,
-                              std::vector<Obj> &objs,
-                              const std::vector<double> &params)
+                              ObjectSet &objs,
+                              const std::vector<double> &params,
+                              int nthreads)
 {
-  cv::Mat final, gray, pyrd, pyru;
-  cv::pyrDown(img, pyrd);
-  cv::pyrUp(pyrd, pyru);
-  cv::cvtColor(pyru, gray, CV_BGR2GRAY);
-  cv::equalizeHist(gray, final);
-  trunc_colors(final, params[0]);
+  Preprocessor prep;
+  get_sorted_objects_from_image(prep, img, objs, params, nthreads);
+}
 
-  objfind(final, objs);
-  sortobjs(objs);
+static void
+write_filter(std::ostream &out, const ObjFilter &filter)
+{
+  out << "area=" << filter.min_area << "-" << filter.max_area
+      << " width=" << filter.min_width << "-" << filter.max_width
+      << " height=" << filter.min_height << "-" << filter.max_height
+      << " aspect=" << filter.min_aspect << "-" << filter.max_aspect
+      << " top=" << filter.top_k << " ignore=";
+  for (size_t i = 0; i < filter.ignore_colors.size(); ++i)
+    out << (i ? "," : "") << filter.ignore_colors[i];
+}
+
+// The sweep labels with objfind_parallel, which is 4-connected, matches
+// colors exactly and keeps every object.
+std::string
+labeler_signature()
+{
+  std::ostringstream out;
+  out << "connectivity=4 tolerance=0 ";
+  write_filter(out, ObjFilter());
+
+  int hist[256];
+  for (int i = 0; i < 256; ++i)
+    hist[i] = 1 + (i * 37) % 11;
+  int npixels = 0;
+  for (int i = 0; i < 256; ++i)
+    npixels += hist[i];
+  for (int ncolors = 2; ncolors <= 32; ncolors *= 2) {
+    uchar table[256];
+    build_color_table(hist, npixels, ncolors, table);
+    out << " lut" << ncolors << "=";
+    for (int i = 0; i < 256; ++i)
+      out << static_cast<int>(table[i]) << (i < 255 ? "," : "");
+  }
+  return out.str();
+}
+
+// Quantizing to step n after step m, where m divides n, is the same as
+// quantizing to step n directly, so the coarser image is the finer one
+// with each color c replaced by (c / n) * n.  Its runs are the finer
+// image's runs with neighbours of the same new color joined.
+void
+get_sorted_objects_for_sweep(Preprocessor &prep,
+                             const cv::Mat &img,
+                             std::vector<ObjectSet> &objs,
+                             const std::vector<std::vector<double> >
+                             &param_sets,
+                             int nthreads)
+{
+  size_t nlevels = param_sets.size();
+  objs.clear();
+  objs.resize(nlevels);
+  if (nlevels == 0)
+    return;
+
+  // Finest levels first, so each can be built from one before it.
+  std::vector<std::pair<int, size_t> > order;
+  for (size_t i = 0; i < nlevels; ++i)
+    order.push_back(std::make_pair(color_step(param_sets[i][0]), i));
+  std::sort(order.begin(), order.end());
+
+  prep.prepare(img);
+  std::vector<RunRows> rows(nlevels);
+  for (size_t k = 0; k < nlevels; ++k) {
+    int step = order[k].first;
+    size_t level = order[k].second;
+
+    // The coarsest finer level whose step divides this one's.
+    size_t from = k;
+    for (size_t j = k; 0 < j--; ) {
+      if (order[j].first != 0 && step % order[j].first == 0) {
+        from = j;
+        break;
+      }
+    }
+
+    if (from == k)
+      objfind_parallel(prep.quantize(param_sets[level][0]), objs[level],
+                       nthreads, &rows[k]);
+    else if (order[from].first == step) {
+      objs[level] = objs[order[from].second];
+      rows[k] = rows[from];
+      continue;
+    }
+    else {
+      uchar map[256];
+      for (int c = 0; c < 256; ++c)
+        map[c] = (c / step) * step;
+      objfind_remapped(rows[from], map, objs[level], &rows[k]);
+    }
+    StageTimer timer("sort");
+    sortobjs(objs[level]);
+  }
 }
@@ -1,6 +1,7 @@
 #ifndef IMAGE_INCLUDED
 #define IMAGE_INCLUDED 1
 
+#include <string>
 #include <vector>
 
 #define CV_NO_BACKWARD_COMPATIBILITY
@@ -8,9 +9,62 @@
 
 #include "objfind.h"
 
+// Prepares images for objfind.  The intermediate images are kept between
+// calls, so a batch of same-sized images allocates them only once.
+class Preprocessor
+{
+public:
+  // Smooths, converts to gray if needed, and equalizes and quantizes to
+  // params[0] colors.  The result stays valid until the next call.
+  const cv::Mat &run(const cv::Mat &image, const std::vector<double> &params);
+
+  // run in two steps, for quantizing one image to several numbers of
+  // colors: prepare smooths and takes the histogram once, and quantize
+  // can then be called for each number of colors.
+  void prepare(const cv::Mat &image);
+  const cv::Mat &quantize(int ncolors);
+
+private:
+  cv::Mat pyrd;
+  cv::Mat pyru;
+  cv::Mat gray;
+  cv::Mat quantized;
+  int hist[256];
+};
+
+// Only the objects filter keeps are extracted and sorted.
+extern void
+get_sorted_objects_from_image(Preprocessor &prep,
+                              const cv::Mat &image,
+                              ObjectSet &objects,
+                              const std::vector<double> &params,
+                              int nthreads = 1,
+                              const ObjFilter &filter = ObjFilter());
+
+// The sorted objects for each of param_sets, which may differ only in
+// the number of colors.  The image is smoothed once, and a level whose
+// color step is a multiple of a finer level's is labeled from that
+// level's runs rather than from its pixels, on nthreads tiles.
+extern void
+get_sorted_objects_for_sweep(Preprocessor &prep,
+                             const cv::Mat &image,
+                             std::vector<ObjectSet> &objects,
+                             const std::vector<std::vector<double> >
+                             &param_sets,
+                             int nthreads = 1);
+
+// Everything besides params that decides which objects
+// get_sorted_objects_for_sweep finds, for keying cached objects: the
+// connectivity, color tolerance and filter it labels with, and the color
+// tables its preprocessing builds from a fixed histogram.  A change to
+// any of them gives a different signature.
+extern std::string
+labeler_signature();
+
 extern void
 get_sorted_objects_from_image(const cv::Mat &image,
-                              std::vector<Obj> &objects,
-                              const std::vector<double> &params);
+                              ObjectSet &objects,
+                              const std::vector<double> &params,
+                              int nthreads = 1);
 
 #endif  // IMAGE_INCLUDED
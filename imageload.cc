@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <fstream>
+
+#define CV_NO_BACKWARD_COMPATIBILITY
+#include <opencv/highgui.h>
+
+#include "imageload.h"
+
+ImageLoader::ImageLoader(ObjCache &cache, int read_threads,
+                         int decode_threads, int objfind_threads,
+                         size_t depth, int tile_threads)
+  : cache(&cache), read_threads(read_threads),
+    decode_threads(decode_threads), objfind_threads(objfind_threads),
+    depth(depth), tile_threads(tile_threads),
+    preps(objfind_threads < 1 ? 1 : objfind_threads)
+{ }
+
+void
+ImageLoader::add_stages(Pipeline &pipeline)
+{
+  pipeline.add_stage(read_file, this, read_threads, depth);
+  pipeline.add_stage(decode_image, this, decode_threads, depth);
+  pipeline.add_stage(find_objects, this, objfind_threads, depth);
+}
+
+bool
+image_job_t::all_cached() const
+{
+  return std::find(cached.begin(), cached.end(), false) == cached.end();
+}
+
+// A file that can't be read leaves bytes empty, which decodes to an
+// empty image, as imread would give, and has no cache entries.
+void *
+ImageLoader::read_file(void *item, void *loader, int)
+{
+  image_job_t *job = static_cast<image_job_t *>(item);
+  ImageLoader *self = static_cast<ImageLoader *>(loader);
+  ProfileScope scope(&job->profile);
+
+  {
+    StageTimer timer("read");
+    std::ifstream file(job->filename.c_str(), std::ios::binary);
+    if (file) {
+      file.seekg(0, std::ios::end);
+      std::streamoff size = file.tellg();
+      file.seekg(0, std::ios::beg);
+      if (0 < size) {
+        job->bytes.resize(size);
+        if (! file.read(reinterpret_cast<char *>(&job->bytes[0]), size))
+          job->bytes.clear();
+      }
+    }
+    profile_bytes("read", job->bytes.size());
+  }
+
+  size_t nsets = job->params.size();
+  job->cached.assign(nsets, false);
+  job->objs.resize(nsets);
+  if (! job->bytes.empty()) {
+    StageTimer timer("cache");
+    job->hashed = true;
+    job->content_hash = ObjCache::content_hash(&job->bytes[0],
+                                               job->bytes.size());
+    for (size_t i = 0; i < nsets; ++i)
+      job->cached[i] = self->cache->load(job->content_hash, job->params[i],
+                                         job->objs[i]);
+  }
+  profile_count("cache_hits",
+                std::count(job->cached.begin(), job->cached.end(), true));
+  if (job->all_cached() && ! job->keep_image)
+    std::vector<uchar>().swap(job->bytes);
+  return job;
+}
+
+void *
+ImageLoader::decode_image(void *item, void *, int)
+{
+  image_job_t *job = static_cast<image_job_t *>(item);
+  ProfileScope scope(&job->profile);
+  if (! job->bytes.empty()) {
+    StageTimer timer("decode");
+    job->image = cv::imdecode(cv::Mat(job->bytes), 1);
+    profile_bytes("decode", job->bytes.size() +
+                  job->image.step * job->image.rows);
+    std::vector<uchar>().swap(job->bytes);
+  }
+  return job;
+}
+
+void *
+ImageLoader::find_objects(void *item, void *loader, int worker)
+{
+  image_job_t *job = static_cast<image_job_t *>(item);
+  ImageLoader *self = static_cast<ImageLoader *>(loader);
+  if (job->all_cached())
+    return job;
+
+  ProfileScope scope(&job->profile);
+  std::vector<std::vector<double> > missing;
+  for (size_t i = 0; i < job->params.size(); ++i) {
+    if (! job->cached[i])
+      missing.push_back(job->params[i]);
+  }
+  std::vector<ObjectSet> found;
+  get_sorted_objects_for_sweep(self->preps[worker], job->image, found,
+                               missing, self->tile_threads);
+
+  StageTimer timer("cache");
+  for (size_t i = 0, m = 0; i < job->params.size(); ++i) {
+    if (job->cached[i])
+      continue;
+    job->objs[i] = found[m++];
+    if (job->hashed)
+      self->cache->store(job->content_hash, job->params[i], job->objs[i]);
+  }
+  if (! job->keep_image)
+    job->image = cv::Mat();
+  return job;
+}
@@ -0,0 +1,70 @@
+#ifndef IMAGELOAD_INCLUDED
+#define IMAGELOAD_INCLUDED 1
+
+#include <string>
+#include <vector>
+
+#define CV_NO_BACKWARD_COMPATIBILITY
+#include <opencv/cv.h>
+
+#include "image.h"
+#include "instrument.h"
+#include "objcache.h"
+#include "objfind.h"
+#include "pipeline.h"
+
+// One image on its way through the loading stages, found with one or
+// more sets of params.  objs[i] and cached[i] are for params[i].
+struct image_job_t {
+  size_t index;  // For the caller, e.g. the image's place in a batch
+  std::string filename;
+  std::vector<std::vector<double> > params;
+  bool keep_image;  // Decode and keep the image even if objs are cached
+  std::vector<bool> cached;
+  std::vector<uchar> bytes;
+  // ObjCache::content_hash of bytes, if the file could be read.
+  bool hashed;
+  unsigned long long content_hash;
+  cv::Mat image;
+  std::vector<ObjectSet> objs;
+  Profile profile;
+
+  image_job_t()
+    : index(0), keep_image(false), hashed(false), content_hash(0) {}
+
+  bool all_cached() const;
+};
+
+// Adds three stages to a pipeline of image_job_t: reading the file,
+// decoding it, and preprocessing and finding the sorted objects.  The
+// file is read once, for both its cache key and decoding.  Jobs whose
+// objects are all in the cache skip the last two, unless they keep the
+// image.  The params sets missing from the cache are found together,
+// sharing the work get_sorted_objects_for_sweep can share.  Decoding is
+// mostly CPU and reading mostly waiting, so each stage gets its own
+// number of threads, and each objfind thread labels an image on
+// tile_threads tiles at once.
+class ImageLoader
+{
+public:
+  ImageLoader(ObjCache &cache, int read_threads, int decode_threads,
+              int objfind_threads, size_t depth, int tile_threads = 1);
+
+  void add_stages(Pipeline &pipeline);
+
+private:
+  ObjCache *cache;
+  int read_threads;
+  int decode_threads;
+  int objfind_threads;
+  size_t depth;
+  int tile_threads;
+  // One per objfind thread.
+  std::vector<Preprocessor> preps;
+
+  static void *read_file(void *item, void *loader, int worker);
+  static void *decode_image(void *item, void *loader, int worker);
+  static void *find_objects(void *item, void *loader, int worker);
+};
+
+#endif  // IMAGELOAD_INCLUDED
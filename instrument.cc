@@ -0,0 +1,230 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <time.h>
+
+#include "instrument.h"
+
+bool profiling_enabled = std::getenv("TEXTECTION_PROFILE") != 0;
+
+void
+Profile::add_time(const std::string &stage, double seconds)
+{
+  StageStats &stats = stage_stats[stage];
+  stats.seconds += seconds;
+  ++stats.calls;
+}
+
+void
+Profile::add_count(const std::string &counter, size_t n)
+{
+  counts[counter] += n;
+}
+
+void
+Profile::note_bytes(const std::string &stage, size_t bytes)
+{
+  StageStats &stats = stage_stats[stage];
+  stats.peak_bytes = std::max(stats.peak_bytes, bytes);
+}
+
+// Times and counts add up; peaks are the largest seen.
+void
+Profile::merge(const Profile &other)
+{
+  stage_map_t::const_iterator stage;
+  for (stage = other.stage_stats.begin(); stage != other.stage_stats.end();
+       ++stage) {
+    StageStats &stats = stage_stats[stage->first];
+    stats.seconds += stage->second.seconds;
+    stats.calls += stage->second.calls;
+    stats.peak_bytes = std::max(stats.peak_bytes, stage->second.peak_bytes);
+  }
+  counter_map_t::const_iterator counter;
+  for (counter = other.counts.begin(); counter != other.counts.end();
+       ++counter)
+    counts[counter->first] += counter->second;
+}
+
+static pthread_key_t current_key;
+static pthread_once_t current_once = PTHREAD_ONCE_INIT;
+
+static void
+make_current_key()
+{
+  pthread_key_create(&current_key, 0);
+}
+
+Profile *
+current_profile()
+{
+  if (! profiling())
+    return 0;
+  pthread_once(&current_once, make_current_key);
+  return static_cast<Profile *>(pthread_getspecific(current_key));
+}
+
+ProfileScope::ProfileScope(Profile *profile)
+  : previous(0), active(profiling())
+{
+  if (active) {
+    previous = current_profile();
+    pthread_setspecific(current_key, profile);
+  }
+}
+
+ProfileScope::~ProfileScope()
+{
+  if (active)
+    pthread_setspecific(current_key, previous);
+}
+
+double
+profile_clock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void
+StageTimer::record()
+{
+  double seconds = profile_clock() - start;
+  if (detail)
+    profile->add_time(std::string(stage) + ":" + detail, seconds);
+  else
+    profile->add_time(stage, seconds);
+}
+
+typedef std::vector<std::pair<std::string, Profile> > profile_log_t;
+
+static profile_log_t *profile_log = 0;
+static pthread_mutex_t profile_log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static std::string
+json_string(const std::string &s)
+{
+  std::string quoted = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '"' || s[i] == '\\')
+      quoted += '\\';
+    quoted += s[i];
+  }
+  return quoted + "\"";
+}
+
+static void
+write_json_profile(std::ostream &out, const Profile &profile)
+{
+  out << "\"stages\": {";
+  Profile::stage_map_t::const_iterator stage;
+  for (stage = profile.stages().begin(); stage != profile.stages().end();
+       ++stage) {
+    out << (stage == profile.stages().begin() ? "" : ", ")
+        << json_string(stage->first) << ": {"
+        << "\"seconds\": " << stage->second.seconds
+        << ", \"calls\": " << stage->second.calls
+        << ", \"peak_bytes\": " << stage->second.peak_bytes << "}";
+  }
+  out << "}, \"counters\": {";
+  Profile::counter_map_t::const_iterator counter;
+  for (counter = profile.counters().begin();
+       counter != profile.counters().end(); ++counter) {
+    out << (counter == profile.counters().begin() ? "" : ", ")
+        << json_string(counter->first) << ": " << counter->second;
+  }
+  out << "}";
+}
+
+static void
+write_json_log(std::ostream &out, const profile_log_t &log,
+               const Profile &total)
+{
+  out << "{\n  \"images\": [\n";
+  for (size_t i = 0; i < log.size(); ++i) {
+    out << "    {\"image\": " << json_string(log[i].first) << ", ";
+    write_json_profile(out, log[i].second);
+    out << "}" << (i + 1 < log.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"total\": {";
+  write_json_profile(out, total);
+  out << "}\n}\n";
+}
+
+static std::string
+csv_field(const std::string &s)
+{
+  if (s.find_first_of(",\"\n") == std::string::npos)
+    return s;
+  std::string quoted = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    if (s[i] == '"')
+      quoted += '"';
+    quoted += s[i];
+  }
+  return quoted + "\"";
+}
+
+// One row per stage or counter: image,kind,name,seconds,calls,peak_bytes,
+// count.
+static void
+write_csv_profile(std::ostream &out, const std::string &image,
+                  const Profile &profile)
+{
+  std::string prefix = csv_field(image);
+  Profile::stage_map_t::const_iterator stage;
+  for (stage = profile.stages().begin(); stage != profile.stages().end();
+       ++stage) {
+    out << prefix << ",stage," << csv_field(stage->first) << ","
+        << stage->second.seconds << "," << stage->second.calls << ","
+        << stage->second.peak_bytes << ",\n";
+  }
+  Profile::counter_map_t::const_iterator counter;
+  for (counter = profile.counters().begin();
+       counter != profile.counters().end(); ++counter) {
+    out << prefix << ",counter," << csv_field(counter->first) << ",,,,"
+        << counter->second << "\n";
+  }
+}
+
+static void
+write_profile_log()
+{
+  pthread_mutex_lock(&profile_log_lock);
+  const profile_log_t &log = *profile_log;
+  Profile total;
+  for (size_t i = 0; i < log.size(); ++i)
+    total.merge(log[i].second);
+
+  std::string filename = std::getenv("TEXTECTION_PROFILE");
+  std::ofstream out(filename.c_str());
+  std::string ext = ".csv";
+  if (ext.size() <= filename.size() &&
+      filename.compare(filename.size() - ext.size(), ext.size(), ext) == 0) {
+    out << "image,kind,name,seconds,calls,peak_bytes,count\n";
+    for (size_t i = 0; i < log.size(); ++i)
+      write_csv_profile(out, log[i].first, log[i].second);
+    write_csv_profile(out, "total", total);
+  } else
+    write_json_log(out, log, total);
+  pthread_mutex_unlock(&profile_log_lock);
+}
+
+void
+log_profile(const std::string &image, const Profile &profile)
+{
+  if (! profiling())
+    return;
+  pthread_mutex_lock(&profile_log_lock);
+  if (! profile_log) {
+    profile_log = new profile_log_t;
+    std::atexit(write_profile_log);
+  }
+  profile_log->push_back(std::make_pair(image, profile));
+  pthread_mutex_unlock(&profile_log_lock);
+}
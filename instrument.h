@@ -0,0 +1,133 @@
+#ifndef INSTRUMENT_INCLUDED
+#define INSTRUMENT_INCLUDED 1
+
+#include <map>
+#include <string>
+
+// Timings and counters for each image, for finding which stage is to
+// blame when a page is slow.  Set TEXTECTION_PROFILE to a file name to
+// turn them on; the log is written there at exit, as CSV if the name
+// ends in .csv and as JSON otherwise.  When it's unset every probe is a
+// test of one global flag.
+//
+// Probes record into the thread's current Profile, set with
+// ProfileScope, so an image's profile follows it from thread to thread
+// through a pipeline.  Probes on a thread with no current profile, such
+// as objfind_parallel's tile threads, record nothing.
+
+struct StageStats {
+  double seconds;
+  size_t calls;
+  // The most bytes the stage's own buffers held at once.
+  size_t peak_bytes;
+
+  StageStats() : seconds(0.), calls(0), peak_bytes(0) {}
+};
+
+class Profile
+{
+public:
+  typedef std::map<std::string, StageStats> stage_map_t;
+  typedef std::map<std::string, size_t> counter_map_t;
+
+  void add_time(const std::string &stage, double seconds);
+  void add_count(const std::string &counter, size_t n);
+  void note_bytes(const std::string &stage, size_t bytes);
+  void merge(const Profile &other);
+
+  const stage_map_t &stages() const { return stage_stats; }
+  const counter_map_t &counters() const { return counts; }
+
+private:
+  stage_map_t stage_stats;
+  counter_map_t counts;
+};
+
+extern bool profiling_enabled;
+
+inline bool
+profiling()
+{
+  return profiling_enabled;
+}
+
+// 0 if profiling is off or no scope is open on this thread.
+extern Profile *
+current_profile();
+
+// Makes profile the current one on this thread until the scope ends.
+class ProfileScope
+{
+public:
+  explicit ProfileScope(Profile *profile);
+  ~ProfileScope();
+
+private:
+  Profile *previous;
+  bool active;
+};
+
+// Seconds on a monotonic clock.
+extern double
+profile_clock();
+
+// Times from construction to destruction as stage, or as "stage:detail"
+// if detail is given.
+class StageTimer
+{
+public:
+  explicit StageTimer(const char *stage, const char *detail = 0)
+    : profile(profiling() ? current_profile() : 0), stage(stage),
+      detail(detail), start(0.)
+  {
+    if (profile)
+      start = profile_clock();
+  }
+
+  ~StageTimer()
+  {
+    stop();
+  }
+
+  // Records the time so far and stops timing.
+  void stop()
+  {
+    if (profile)
+      record();
+    profile = 0;
+  }
+
+private:
+  Profile *profile;
+  const char *stage;
+  const char *detail;
+  double start;
+
+  void record();
+};
+
+inline void
+profile_count(const char *counter, size_t n)
+{
+  if (profiling()) {
+    Profile *profile = current_profile();
+    if (profile)
+      profile->add_count(counter, n);
+  }
+}
+
+inline void
+profile_bytes(const char *stage, size_t bytes)
+{
+  if (profiling()) {
+    Profile *profile = current_profile();
+    if (profile)
+      profile->note_bytes(stage, bytes);
+  }
+}
+
+// Adds a finished image's profile to the log.  Safe from any thread.
+extern void
+log_profile(const std::string &image, const Profile &profile);
+
+#endif  // INSTRUMENT_INCLUDED
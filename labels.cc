@@ -0,0 +1,290 @@
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <sstream>
+
+#include <boost/lexical_cast.hpp>
+
+#include "labels.h"
+
+static const char *schema[] = {
+  "CREATE TABLE IF NOT EXISTS images ("
+  " id INTEGER PRIMARY KEY,"
+  " filename TEXT NOT NULL UNIQUE)",
+
+  "CREATE TABLE IF NOT EXISTS params ("
+  " id INTEGER PRIMARY KEY,"
+  " text TEXT NOT NULL UNIQUE)",
+
+  "CREATE TABLE IF NOT EXISTS labelings ("
+  " image_id INTEGER NOT NULL REFERENCES images (id),"
+  " params_id INTEGER NOT NULL REFERENCES params (id),"
+  " done INTEGER NOT NULL DEFAULT 0,"
+  " PRIMARY KEY (image_id, params_id)"
+  ") WITHOUT ROWID",
+
+  "CREATE TABLE IF NOT EXISTS labels ("
+  " image_id INTEGER NOT NULL,"
+  " params_id INTEGER NOT NULL,"
+  " y INTEGER NOT NULL,"
+  " x INTEGER NOT NULL,"
+  " char INTEGER NOT NULL,"
+  " PRIMARY KEY (image_id, params_id, y, x)"
+  ") WITHOUT ROWID",
+
+  0
+};
+
+void
+ensure_label_schema(sqlite3 *db)
+{
+  for (const char **stmt = schema; *stmt; ++stmt)
+    SQL_OK(sqlite3_exec(db, *stmt, 0, 0, 0));
+}
+
+// Same formatting the legacy table names used.
+std::string
+format_params(const std::vector<double> &params)
+{
+  std::stringstream buffer;
+  for (size_t i = 0; i < params.size(); ++i) {
+    if (i != 0)
+      buffer << ',';
+    buffer << params[i];
+  }
+  return buffer.str();
+}
+
+void
+parse_params(const std::string &text, std::vector<double> &params)
+{
+  size_t start = 0;
+  size_t end;
+  do {
+    end = text.find(',', start);
+    std::string num = text.substr(start, end - start);
+    params.push_back(boost::lexical_cast<double>(num));
+    start = end + 1;
+  } while (end != std::string::npos);
+}
+
+// Called once or twice per image, so the statements are cached rather
+// than prepared each time.
+static int
+find_or_add(sqlite3 *db, const char *insert, const char *select,
+            const std::string &key)
+{
+  SqlStatementCache &cache = SqlStatementCache::of(db);
+  SqlStatement &add = cache.get(insert);
+  add.bind(1, key).run();
+
+  SqlStatement &find = cache.get(select);
+  find.bind(1, key);
+  bool found = find.step();
+  assert(found);
+  int id = find.column_int(0);
+  find.reset();
+  return id;
+}
+
+int
+image_id(sqlite3 *db, const std::string &filename)
+{
+  return find_or_add(db,
+                     "INSERT OR IGNORE INTO images (filename) VALUES (?)",
+                     "SELECT id FROM images WHERE filename=?",
+                     filename);
+}
+
+int
+params_id(sqlite3 *db, const std::vector<double> &params)
+{
+  return find_or_add(db,
+                     "INSERT OR IGNORE INTO params (text) VALUES (?)",
+                     "SELECT id FROM params WHERE text=?",
+                     format_params(params));
+}
+
+static const char *labeling_select =
+  "SELECT labelings.image_id, labelings.params_id,"
+  " images.filename, params.text, labelings.done"
+  " FROM labelings"
+  " JOIN images ON images.id = labelings.image_id"
+  " JOIN params ON params.id = labelings.params_id";
+
+static void
+read_labeling(SqlStatement &stmt, labeling_t &labeling)
+{
+  labeling.image_id = stmt.column_int(0);
+  labeling.params_id = stmt.column_int(1);
+  labeling.filename = stmt.column_text(2);
+  labeling.params.clear();
+  parse_params(stmt.column_text(3), labeling.params);
+  labeling.done = stmt.column_int(4) != 0;
+}
+
+bool
+find_labeling(sqlite3 *db, int image_id, int params_id,
+              labeling_t &labeling)
+{
+  std::string sql = std::string(labeling_select) +
+    " WHERE labelings.image_id=? AND labelings.params_id=?";
+  SqlStatement &stmt = SqlStatementCache::of(db).get(sql);
+  stmt.bind(1, image_id).bind(2, params_id);
+  if (! stmt.step())
+    return false;
+  read_labeling(stmt, labeling);
+  stmt.reset();
+  return true;
+}
+
+void
+begin_labeling(sqlite3 *db, int image_id, int params_id)
+{
+  SqlStatement &stmt = SqlStatementCache::of(db).get(
+    "INSERT OR IGNORE INTO labelings (image_id, params_id) VALUES (?, ?)"
+    );
+  stmt.bind(1, image_id).bind(2, params_id).run();
+}
+
+void
+finish_labeling(sqlite3 *db, int image_id, int params_id)
+{
+  SqlStatement &stmt = SqlStatementCache::of(db).get(
+    "UPDATE labelings SET done=1 WHERE image_id=? AND params_id=?"
+    );
+  stmt.bind(1, image_id).bind(2, params_id).run();
+}
+
+void
+load_labelings(sqlite3 *db, std::vector<labeling_t> &labelings)
+{
+  std::string sql = std::string(labeling_select) +
+    " ORDER BY labelings.image_id, labelings.params_id";
+  SqlStatement stmt(db, sql);
+  while (stmt.step()) {
+    labelings.push_back(labeling_t());
+    read_labeling(stmt, labelings.back());
+  }
+}
+
+void
+load_labels(sqlite3 *db, int image_id, int params_id,
+            std::vector<label_t> &labels)
+{
+  SqlStatement &stmt = SqlStatementCache::of(db).get(
+    "SELECT x, y, char FROM labels WHERE image_id=? AND params_id=?"
+    " ORDER BY y, x"
+    );
+  stmt.bind(1, image_id).bind(2, params_id);
+  while (stmt.step()) {
+    label_t label;
+    label.x = stmt.column_int(0);
+    label.y = stmt.column_int(1);
+    label.c = stmt.column_int(2);
+    labels.push_back(label);
+  }
+}
+
+const label_t *
+find_label(const std::vector<label_t> &labels, int x, int y)
+{
+  label_t key;
+  key.x = x;
+  key.y = y;
+  key.c = 0;
+  std::vector<label_t>::const_iterator iter =
+    std::lower_bound(labels.begin(), labels.end(), key, label_less);
+  if (iter == labels.end() || iter->y != y || iter->x != x)
+    return 0;
+  return &*iter;
+}
+
+std::vector<std::string>
+label_columns()
+{
+  std::vector<std::string> columns;
+  columns.push_back("image_id");
+  columns.push_back("params_id");
+  columns.push_back("x");
+  columns.push_back("y");
+  columns.push_back("char");
+  return columns;
+}
+
+void
+find_legacy_label_tables(sqlite3 *db, std::vector<std::string> &names)
+{
+  SqlStatement stmt(
+    db, "SELECT name FROM sqlite_master WHERE type='table' AND name LIKE '%+%'"
+    );
+  while (stmt.step())
+    names.push_back(stmt.column_text(0));
+}
+
+bool
+check_no_legacy_label_tables(sqlite3 *db, const std::string &filename)
+{
+  std::vector<std::string> legacy;
+  find_legacy_label_tables(db, legacy);
+  if (legacy.empty())
+    return true;
+  std::cerr << filename << " has " << legacy.size()
+            << " per-image label tables; run migrate first\n";
+  return false;
+}
+
+static std::string
+quote_name(const std::string &name)
+{
+  std::string quoted = "'";
+  for (size_t i = 0; i < name.size(); ++i) {
+    quoted += name[i];
+    if (name[i] == '\'')
+      quoted += '\'';
+  }
+  return quoted + "'";
+}
+
+// Duplicate positions keep the first label, as features always has.
+static void
+migrate_legacy_label_table(sqlite3 *db, const std::string &name)
+{
+  size_t plus_index = name.find_last_of('+');
+  std::vector<double> params;
+  parse_params(name.substr(plus_index + 1), params);
+  int image = image_id(db, name.substr(0, plus_index));
+  int param_set = params_id(db, params);
+
+  {
+    SqlStatement copy(
+      db,
+      "INSERT OR IGNORE INTO labels (image_id, params_id, x, y, char)"
+      " SELECT ?, ?, x, y, char FROM " + quote_name(name) + " ORDER BY rowid"
+      );
+    copy.bind(1, image).bind(2, param_set).run();
+  }
+
+  begin_labeling(db, image, param_set);
+  finish_labeling(db, image, param_set);
+
+  std::string drop = "DROP TABLE " + quote_name(name);
+  SQL_OK(sqlite3_exec(db, drop.c_str(), 0, 0, 0));
+}
+
+size_t
+migrate_legacy_label_tables(sqlite3 *db)
+{
+  ensure_label_schema(db);
+
+  std::vector<std::string> names;
+  find_legacy_label_tables(db, names);
+  if (names.empty())
+    return 0;
+
+  SQL_OK(sqlite3_exec(db, "BEGIN", 0, 0, 0));
+  for (size_t i = 0; i < names.size(); ++i)
+    migrate_legacy_label_table(db, names[i]);
+  SQL_OK(sqlite3_exec(db, "COMMIT", 0, 0, 0));
+  return names.size();
+}
@@ -0,0 +1,102 @@
+#ifndef LABELS_INCLUDED
+#define LABELS_INCLUDED 1
+
+#include <string>
+#include <vector>
+
+#include "sql.h"
+
+// Labels live in one table keyed by image, parameters and position:
+//
+//   images (id, filename)
+//   params (id, text)              e.g. "8" or "8,1.5"
+//   labelings (image_id, params_id, done)
+//   labels (image_id, params_id, y, x, char)
+//
+// A labeling is one pass of train over an image with some parameters;
+// done is set once every object has been seen or the rest skipped.
+// labels is clustered on its key, so an image's labels are one range
+// scan, sorted by row and then column.
+
+struct label_t {
+  int x, y, c;
+};
+
+// The order labels are stored and loaded in.
+inline bool
+label_less(const label_t &l1, const label_t &l2)
+{
+  return l1.y < l2.y || (l1.y == l2.y && l1.x < l2.x);
+}
+
+struct labeling_t {
+  int image_id;
+  int params_id;
+  std::string filename;
+  std::vector<double> params;
+  bool done;
+};
+
+// Creates whatever tables and indexes are missing.
+extern void
+ensure_label_schema(sqlite3 *db);
+
+extern std::string
+format_params(const std::vector<double> &params);
+
+extern void
+parse_params(const std::string &text, std::vector<double> &params);
+
+// Ids for the filename and params, added if they're new.
+extern int
+image_id(sqlite3 *db, const std::string &filename);
+
+extern int
+params_id(sqlite3 *db, const std::vector<double> &params);
+
+// Looks up a labeling, returning false if there isn't one.
+extern bool
+find_labeling(sqlite3 *db, int image_id, int params_id,
+              labeling_t &labeling);
+
+extern void
+begin_labeling(sqlite3 *db, int image_id, int params_id);
+
+extern void
+finish_labeling(sqlite3 *db, int image_id, int params_id);
+
+// Every labeling, in order of image and params.
+extern void
+load_labelings(sqlite3 *db, std::vector<labeling_t> &labelings);
+
+// A labeling's labels, sorted by y and then x.
+extern void
+load_labels(sqlite3 *db, int image_id, int params_id,
+            std::vector<label_t> &labels);
+
+// The label at (x, y) in labels sorted by label_less, or 0 if there
+// isn't one.
+extern const label_t *
+find_label(const std::vector<label_t> &labels, int x, int y);
+
+// Columns for SqlBulkInsert into labels, bound in this order.
+extern std::vector<std::string>
+label_columns();
+
+// Tables from before the labels schema, one per labeling and named
+// "filename+params".
+extern void
+find_legacy_label_tables(sqlite3 *db, std::vector<std::string> &names);
+
+// True if db has no legacy tables.  Otherwise tells the user to run
+// migrate, since labeling or importing on top of them would start a
+// second set of labels the legacy ones don't show up in.
+extern bool
+check_no_legacy_label_tables(sqlite3 *db, const std::string &filename);
+
+// Moves every legacy table into labels, marking each labeling done, and
+// drops it.  Returns the number of tables moved.
+extern size_t
+migrate_legacy_label_tables(sqlite3 *db);
+
+#endif  // LABELS_INCLUDED
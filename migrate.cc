@@ -0,0 +1,23 @@
+#include <iostream>
+
+#include "labels.h"
+#include "sql.h"
+
+// Moves the per-image label tables of an older objs.sqlite, or the
+// database named on the command line, into the labels schema.
+int
+main(int argc, char **argv)
+{
+  const char *filename = (1 < argc) ? argv[1] : "objs.sqlite";
+  sqlite3 *db;
+  SQL_OK(open_sql_db_and_ensure_close_on_exit(filename, &db));
+
+  size_t moved = migrate_legacy_label_tables(db);
+  std::cout << filename << ": migrated " << moved << " tables\n";
+
+  // Give back the space the dropped tables took.
+  if (moved)
+    SQL_OK(sqlite3_exec(db, "VACUUM", 0, 0, 0));
+
+  return 0;
+}
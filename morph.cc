@@ -0,0 +1,504 @@
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <vector>
+
+#include "morph.h"
+
+typedef std::vector<Run> runs_t;
+
+// The runs of one row, runs[begin] up to (but not including) runs[end].
+struct row_span_t {
+  int row;
+  size_t begin;
+  size_t end;
+};
+
+static bool
+run_less(const Run &r1, const Run &r2)
+{
+  return r1.row < r2.row || (r1.row == r2.row && r1.start < r2.start);
+}
+
+static bool
+span_row_less(const row_span_t &span, int row)
+{
+  return span.row < row;
+}
+
+static void
+split_rows(const runs_t &runs, std::vector<row_span_t> &rows)
+{
+  rows.clear();
+  for (size_t i = 0; i < runs.size(); ++i) {
+    if (rows.empty() || rows.back().row != runs[i].row) {
+      row_span_t span;
+      span.row = runs[i].row;
+      span.begin = i;
+      rows.push_back(span);
+    }
+    rows.back().end = i + 1;
+  }
+}
+
+// 0 if row has no runs.
+static const row_span_t *
+find_row(const std::vector<row_span_t> &rows, int row)
+{
+  std::vector<row_span_t>::const_iterator iter =
+    std::lower_bound(rows.begin(), rows.end(), row, span_row_less);
+  return (iter != rows.end() && iter->row == row) ? &*iter : 0;
+}
+
+// Appends [start, end) to row, which must be out's last row or a later
+// one, joining it to the last run if they overlap or touch.  Starts must
+// come in order within a row.
+static void
+add_run(runs_t &out, int row, int start, int end)
+{
+  if (end <= start)
+    return;
+  if (! out.empty() && out.back().row == row && start <= out.back().end) {
+    out.back().end = std::max(out.back().end, end);
+    return;
+  }
+  Run run;
+  run.row = row;
+  run.start = start;
+  run.end = end;
+  run.flags = 0;
+  out.push_back(run);
+}
+
+// Runs that touch in a row, as a labeler with a color tolerance can
+// leave, are joined, so every operation sees each row as disjoint
+// intervals.
+template <typename ObjT>
+static void
+copy_runs(const ObjT &obj, runs_t &runs)
+{
+  runs.clear();
+  runs.reserve(obj.runs.size());
+  for (size_t i = 0; i < obj.runs.size(); ++i) {
+    Run run = obj.runs[i];
+    add_run(runs, run.row, run.start, run.end);
+  }
+}
+
+// Sets flags, area and bound from runs, which become dst's.
+static void
+finish_obj(runs_t &runs, int color, Obj &dst)
+{
+  std::vector<row_span_t> rows;
+  split_rows(runs, rows);
+
+  const int maxint = std::numeric_limits<int>::max();
+  int left = maxint, right = -maxint;
+  size_t area = 0;
+  for (size_t i = 0; i < runs.size(); ++i) {
+    runs[i].flags = RUN_TOP | RUN_BOTTOM;
+    area += runs[i].end - runs[i].start;
+    left = std::min(left, runs[i].start);
+    right = std::max(right, runs[i].end);
+  }
+
+  // Runs touching between neighbouring rows, found by one sweep over
+  // each pair of rows.
+  for (size_t r = 1; r < rows.size(); ++r) {
+    if (rows[r].row != rows[r - 1].row + 1)
+      continue;
+    size_t above = rows[r - 1].begin;
+    for (size_t i = rows[r].begin; i < rows[r].end; ++i) {
+      while (above < rows[r - 1].end && runs[above].end <= runs[i].start)
+        ++above;
+      for (size_t j = above; j < rows[r - 1].end; ++j) {
+        if (runs[i].end <= runs[j].start)
+          break;
+        runs[i].flags &= ~RUN_TOP;
+        runs[j].flags &= ~RUN_BOTTOM;
+      }
+    }
+  }
+
+  dst.runs.swap(runs);
+  dst.area = area;
+  dst.color = color;
+  if (dst.runs.empty())
+    dst.bound = cv::Rect();
+  else
+    dst.bound = cv::Rect(left, rows.front().row, right - left,
+                         rows.back().row - rows.front().row + 1);
+}
+
+// How far a kernel of this size reaches before and after its anchor,
+// looking at a dilated pixel's sources.
+static void
+kernel_reach(int size, int &before, int &after)
+{
+  assert(0 < size);
+  before = (size - 1) / 2;
+  after = size - 1 - before;
+}
+
+// Every run is widened by the kernel and copied to each row the kernel
+// covers; sorting and joining them gives the dilated rows.
+static void
+dilate_runs(const runs_t &src, int width, int height, runs_t &dst)
+{
+  int left, right, up, down;
+  kernel_reach(width, left, right);
+  kernel_reach(height, up, down);
+
+  runs_t spread;
+  spread.reserve(src.size() * height);
+  for (size_t i = 0; i < src.size(); ++i) {
+    Run run = src[i];
+    run.start -= left;
+    run.end += right;
+    for (int dy = -up; dy <= down; ++dy) {
+      Run moved = run;
+      moved.row = src[i].row + dy;
+      spread.push_back(moved);
+    }
+  }
+  std::sort(spread.begin(), spread.end(), run_less);
+
+  dst.clear();
+  for (size_t i = 0; i < spread.size(); ++i)
+    add_run(dst, spread[i].row, spread[i].start, spread[i].end);
+}
+
+// Intersects the sorted, disjoint runs of one row of each object.
+static void
+intersect_row(const Run *a, size_t na, const Run *b, size_t nb, int row,
+              runs_t &out)
+{
+  size_t i = 0, j = 0;
+  while (i < na && j < nb) {
+    int start = std::max(a[i].start, b[j].start);
+    int end = std::min(a[i].end, b[j].end);
+    add_run(out, row, start, end);
+    if (a[i].end < b[j].end)
+      ++i;
+    else
+      ++j;
+  }
+}
+
+// A pixel stays if the kernel around it fits in the object: in each row
+// the kernel covers, some run holds the kernel's whole width.  So a row
+// of the result is the intersection of the shrunken runs of the rows
+// around it.
+static void
+erode_runs(const runs_t &src, int width, int height, runs_t &dst)
+{
+  int left, right, up, down;
+  kernel_reach(width, left, right);
+  kernel_reach(height, up, down);
+
+  std::vector<row_span_t> rows;
+  split_rows(src, rows);
+
+  // Each row's runs, less the kernel's reach on either side.
+  runs_t shrunk;
+  for (size_t r = 0; r < rows.size(); ++r) {
+    size_t begin = shrunk.size();
+    for (size_t i = rows[r].begin; i < rows[r].end; ++i)
+      add_run(shrunk, rows[r].row, src[i].start + right, src[i].end - left);
+    rows[r].begin = begin;
+    rows[r].end = shrunk.size();
+  }
+
+  dst.clear();
+  runs_t row_runs, narrowed;
+  for (size_t r = 0; r < rows.size(); ++r) {
+    int row = rows[r].row;
+    row_runs.assign(shrunk.begin() + rows[r].begin,
+                    shrunk.begin() + rows[r].end);
+    for (int dy = -down; dy <= up && ! row_runs.empty(); ++dy) {
+      if (dy == 0)
+        continue;
+      const row_span_t *other = find_row(rows, row + dy);
+      if (! other) {
+        row_runs.clear();
+        break;
+      }
+      narrowed.clear();
+      intersect_row(&row_runs[0], row_runs.size(),
+                    &shrunk[0] + other->begin, other->end - other->begin,
+                    row, narrowed);
+      row_runs.swap(narrowed);
+    }
+    dst.insert(dst.end(), row_runs.begin(), row_runs.end());
+  }
+}
+
+enum set_op_t { SET_UNION, SET_INTERSECT, SET_SUBTRACT };
+
+static void
+combine_row(const Run *a, size_t na, const Run *b, size_t nb, int row,
+            set_op_t op, runs_t &out)
+{
+  if (op == SET_UNION) {
+    size_t i = 0, j = 0;
+    while (i < na || j < nb) {
+      const Run &next = (j == nb || (i < na && a[i].start < b[j].start))
+        ? a[i++] : b[j++];
+      add_run(out, row, next.start, next.end);
+    }
+  } else if (op == SET_INTERSECT) {
+    intersect_row(a, na, b, nb, row, out);
+  } else {
+    size_t j = 0;
+    for (size_t i = 0; i < na; ++i) {
+      int start = a[i].start;
+      while (j < nb && b[j].end <= start)
+        ++j;
+      for (size_t k = j; k < nb && b[k].start < a[i].end; ++k) {
+        add_run(out, row, start, b[k].start);
+        start = std::max(start, b[k].end);
+      }
+      add_run(out, row, start, a[i].end);
+    }
+  }
+}
+
+// Walks the rows of both objects together.
+static void
+combine_runs(const runs_t &a, const runs_t &b, set_op_t op, runs_t &dst)
+{
+  std::vector<row_span_t> arows, brows;
+  split_rows(a, arows);
+  split_rows(b, brows);
+
+  dst.clear();
+  const Run *none = 0;
+  size_t i = 0, j = 0;
+  while (i < arows.size() || j < brows.size()) {
+    bool in_a = i < arows.size() &&
+      (j == brows.size() || arows[i].row <= brows[j].row);
+    bool in_b = j < brows.size() &&
+      (i == arows.size() || brows[j].row <= arows[i].row);
+    int row = in_a ? arows[i].row : brows[j].row;
+    const Run *ra = in_a ? &a[arows[i].begin] : none;
+    size_t na = in_a ? arows[i].end - arows[i].begin : 0;
+    const Run *rb = in_b ? &b[brows[j].begin] : none;
+    size_t nb = in_b ? brows[j].end - brows[j].begin : 0;
+    combine_row(ra, na, rb, nb, row, op, dst);
+    if (in_a)
+      ++i;
+    if (in_b)
+      ++j;
+  }
+}
+
+// The background of each row from the object's top row to its bottom
+// one, including the unbounded parts left and right of the runs, is
+// split into gaps.  Gaps touching in neighbouring rows, corners
+// included, are found by one sweep over each pair of rows, and joined
+// by a walk from the gaps known to be outside: the unbounded ones and
+// those next to a row with no runs.  Gaps the walk doesn't reach are
+// holes.
+static void
+fill_holes_runs(const runs_t &src, runs_t &dst)
+{
+  std::vector<row_span_t> rows;
+  split_rows(src, rows);
+  dst = src;
+  if (rows.size() < 3)
+    return;
+
+  const int far = std::numeric_limits<int>::max() / 2;
+  runs_t gaps;
+  std::vector<row_span_t> gap_rows(rows.size());
+  for (size_t r = 0; r < rows.size(); ++r) {
+    row_span_t &span = gap_rows[r];
+    span.row = rows[r].row;
+    span.begin = gaps.size();
+    int start = -far;
+    for (size_t i = rows[r].begin; i < rows[r].end; ++i) {
+      add_run(gaps, span.row, start, src[i].start);
+      start = src[i].end;
+    }
+    add_run(gaps, span.row, start, far);
+    span.end = gaps.size();
+  }
+
+  // Touching pairs, kept both ways round, then laid out by gap as the
+  // run graph's edges are: gap g's neighbours are links[offsets[g]] up
+  // to links[offsets[g + 1]].
+  std::vector<std::pair<size_t, size_t> > pairs;
+  for (size_t r = 1; r < gap_rows.size(); ++r) {
+    if (gap_rows[r].row != gap_rows[r - 1].row + 1)
+      continue;
+    size_t above = gap_rows[r - 1].begin;
+    size_t above_end = gap_rows[r - 1].end;
+    for (size_t g = gap_rows[r].begin; g < gap_rows[r].end; ++g) {
+      while (above < above_end && gaps[above].end < gaps[g].start)
+        ++above;
+      for (size_t n = above; n < above_end; ++n) {
+        if (gaps[g].end < gaps[n].start)
+          break;
+        pairs.push_back(std::make_pair(g, n));
+        pairs.push_back(std::make_pair(n, g));
+      }
+    }
+  }
+  std::vector<size_t> offsets(gaps.size() + 1, 0);
+  for (size_t p = 0; p < pairs.size(); ++p)
+    ++offsets[pairs[p].first + 1];
+  for (size_t g = 0; g < gaps.size(); ++g)
+    offsets[g + 1] += offsets[g];
+  std::vector<size_t> links(pairs.size());
+  std::vector<size_t> next(offsets.begin(), offsets.end() - 1);
+  for (size_t p = 0; p < pairs.size(); ++p)
+    links[next[pairs[p].first]++] = pairs[p].second;
+
+  std::vector<bool> outside(gaps.size(), false);
+  std::vector<size_t> stack;
+  for (size_t r = 0; r < gap_rows.size(); ++r) {
+    bool open_row = r == 0 || r + 1 == gap_rows.size() ||
+      gap_rows[r - 1].row + 1 != gap_rows[r].row ||
+      gap_rows[r + 1].row - 1 != gap_rows[r].row;
+    for (size_t g = gap_rows[r].begin; g < gap_rows[r].end; ++g) {
+      if (open_row || gaps[g].start == -far || gaps[g].end == far) {
+        outside[g] = true;
+        stack.push_back(g);
+      }
+    }
+  }
+
+  while (! stack.empty()) {
+    size_t g = stack.back();
+    stack.pop_back();
+    for (size_t l = offsets[g]; l < offsets[g + 1]; ++l) {
+      size_t n = links[l];
+      if (! outside[n]) {
+        outside[n] = true;
+        stack.push_back(n);
+      }
+    }
+  }
+
+  runs_t holes;
+  for (size_t g = 0; g < gaps.size(); ++g) {
+    if (! outside[g])
+      holes.push_back(gaps[g]);
+  }
+  combine_runs(src, holes, SET_UNION, dst);
+}
+
+template <typename ObjT>
+static void
+morph_obj(const ObjT &src, int width, int height, bool dilate_first,
+          int steps, Obj &dst)
+{
+  runs_t runs, result;
+  copy_runs(src, runs);
+  for (int step = 0; step < steps; ++step) {
+    if ((step == 0) == dilate_first)
+      dilate_runs(runs, width, height, result);
+    else
+      erode_runs(runs, width, height, result);
+    runs.swap(result);
+  }
+  finish_obj(runs, src.color, dst);
+}
+
+void
+dilateobj(const Obj &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, true, 1, dst);
+}
+
+void
+dilateobj(const ObjView &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, true, 1, dst);
+}
+
+void
+erodeobj(const Obj &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, false, 1, dst);
+}
+
+void
+erodeobj(const ObjView &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, false, 1, dst);
+}
+
+void
+closeobj(const Obj &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, true, 2, dst);
+}
+
+void
+closeobj(const ObjView &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, true, 2, dst);
+}
+
+void
+openobj(const Obj &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, false, 2, dst);
+}
+
+void
+openobj(const ObjView &src, int width, int height, Obj &dst)
+{
+  morph_obj(src, width, height, false, 2, dst);
+}
+
+static void
+set_op_obj(const Obj &a, const Obj &b, set_op_t op, Obj &dst)
+{
+  runs_t ra, rb, runs;
+  copy_runs(a, ra);
+  copy_runs(b, rb);
+  combine_runs(ra, rb, op, runs);
+  finish_obj(runs, a.color, dst);
+}
+
+void
+unionobj(const Obj &a, const Obj &b, Obj &dst)
+{
+  set_op_obj(a, b, SET_UNION, dst);
+}
+
+void
+intersectobj(const Obj &a, const Obj &b, Obj &dst)
+{
+  set_op_obj(a, b, SET_INTERSECT, dst);
+}
+
+void
+subtractobj(const Obj &a, const Obj &b, Obj &dst)
+{
+  set_op_obj(a, b, SET_SUBTRACT, dst);
+}
+
+template <typename ObjT>
+static void
+fillholes_obj(const ObjT &src, Obj &dst)
+{
+  runs_t runs, filled;
+  copy_runs(src, runs);
+  fill_holes_runs(runs, filled);
+  finish_obj(filled, src.color, dst);
+}
+
+void
+fillholes(const Obj &src, Obj &dst)
+{
+  fillholes_obj(src, dst);
+}
+
+void
+fillholes(const ObjView &src, Obj &dst)
+{
+  fillholes_obj(src, dst);
+}
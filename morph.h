@@ -0,0 +1,40 @@
+#ifndef MORPH_INCLUDED
+#define MORPH_INCLUDED 1
+
+#include "objfind.h"
+
+// Morphology and set operations done on objects' runs, without drawing
+// them into an image, so they cost about the number of runs (times the
+// kernel height) rather than the number of pixels.
+//
+// Runs are taken and given in raster order, as objfind lays them out.
+// Results may be in several pieces, e.g. after erosion or subtraction,
+// and keep src's (or a's) color.  Their runs have RUN_TOP if no run
+// touches them from above and RUN_BOTTOM if none touches them from below.
+//
+// Kernels are width x height rectangles anchored at (width / 2,
+// height / 2), as cv::dilate and cv::erode anchor them by default.
+
+void dilateobj(const Obj &src, int width, int height, Obj &dst);
+void dilateobj(const ObjView &src, int width, int height, Obj &dst);
+void erodeobj(const Obj &src, int width, int height, Obj &dst);
+void erodeobj(const ObjView &src, int width, int height, Obj &dst);
+// Dilation then erosion: joins strokes broken by gaps smaller than the
+// kernel.
+void closeobj(const Obj &src, int width, int height, Obj &dst);
+void closeobj(const ObjView &src, int width, int height, Obj &dst);
+// Erosion then dilation: drops spurs thinner than the kernel.
+void openobj(const Obj &src, int width, int height, Obj &dst);
+void openobj(const ObjView &src, int width, int height, Obj &dst);
+
+void unionobj(const Obj &a, const Obj &b, Obj &dst);
+void intersectobj(const Obj &a, const Obj &b, Obj &dst);
+// a without b.
+void subtractobj(const Obj &a, const Obj &b, Obj &dst);
+
+// Fills the background regions that don't reach outside the object,
+// counting regions that touch at a corner as one.
+void fillholes(const Obj &src, Obj &dst);
+void fillholes(const ObjView &src, Obj &dst);
+
+#endif  // MORPH_INCLUDED
@@ -0,0 +1,212 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "objcache.h"
+
+// An entry is this header followed by the arrays of an ObjectSet, the
+// size_t arrays first so each array is aligned for its type:
+//
+//   offsets, counts, areas   size_t[nobjs]
+//   runs                     ShortRun[nruns], or Run[nruns] if wide
+//   colors                   int[nobjs]
+//   bounds                   cv::Rect[nobjs]
+//
+// Entries are only read by the same build that wrote them, so the
+// layout is the native one.
+struct cache_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t wide;
+  uint32_t word_size;
+  uint32_t unused;
+  uint64_t content_hash;
+  uint64_t params_hash;
+  uint64_t nobjs;
+  uint64_t nruns;
+};
+
+static const char CACHE_MAGIC[8] = { 'T', 'X', 'O', 'B', 'J', 'S', 0, 1 };
+
+static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+// FNV-1a, continuing from hash.
+static uint64_t
+fnv1a(uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *bytes = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+static size_t
+run_size(bool wide)
+{
+  return wide ? sizeof(Run) : sizeof(ShortRun);
+}
+
+static size_t
+entry_size(const cache_header_t &header)
+{
+  return sizeof(header) +
+    header.nobjs * (3 * sizeof(size_t) + sizeof(int) + sizeof(cv::Rect)) +
+    header.nruns * run_size(header.wide);
+}
+
+ObjCache::ObjCache(const std::string &labeler, const std::string &dir)
+  : dir(dir), labeler_hash(fnv1a(FNV_OFFSET, labeler.data(), labeler.size()))
+{
+  mkdir(dir.c_str(), 0777);
+}
+
+unsigned long long
+ObjCache::content_hash(const void *data, size_t size)
+{
+  return fnv1a(FNV_OFFSET, data, size);
+}
+
+void
+ObjCache::entry_path(unsigned long long content_hash,
+                     const std::vector<double> &params,
+                     unsigned long long &params_hash, std::string &path) const
+{
+  unsigned int version = OBJCACHE_VERSION;
+  uint64_t hash = fnv1a(FNV_OFFSET, &version, sizeof(version));
+  hash = fnv1a(hash, &labeler_hash, sizeof(labeler_hash));
+  if (! params.empty())
+    hash = fnv1a(hash, &params[0], params.size() * sizeof(params[0]));
+  params_hash = hash;
+
+  char name[40];
+  std::sprintf(name, "/%016llx-%016llx", content_hash, params_hash);
+  path = dir + name;
+}
+
+template<typename T>
+static const char *
+read_array(const char *p, size_t n, std::vector<T> &array)
+{
+  const T *begin = reinterpret_cast<const T *>(p);
+  array.assign(begin, begin + n);
+  return p + n * sizeof(T);
+}
+
+template<typename T>
+static bool
+write_array(FILE *out, const std::vector<T> &array)
+{
+  return array.empty() ||
+    std::fwrite(&array[0], sizeof(T), array.size(), out) == array.size();
+}
+
+// The entry is mapped rather than read, so each array is copied once
+// straight from the page cache into its vector.
+bool
+ObjCache::load(unsigned long long content_hash,
+               const std::vector<double> &params, ObjectSet &objs) const
+{
+  unsigned long long params_hash;
+  std::string path;
+  entry_path(content_hash, params, params_hash, path);
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(cache_header_t)) {
+    close(fd);
+    return false;
+  }
+  size_t size = info.st_size;
+  void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const cache_header_t &header = *static_cast<const cache_header_t *>(map);
+  bool valid =
+    std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+    header.version == OBJCACHE_VERSION &&
+    header.word_size == sizeof(size_t) &&
+    header.content_hash == content_hash &&
+    header.params_hash == params_hash &&
+    entry_size(header) == size;
+
+  if (valid) {
+    const char *p = static_cast<const char *>(map) + sizeof(header);
+    objs.clear();
+    objs.wide = header.wide;
+    p = read_array(p, header.nobjs, objs.offsets);
+    p = read_array(p, header.nobjs, objs.counts);
+    p = read_array(p, header.nobjs, objs.areas);
+    if (objs.wide)
+      p = read_array(p, header.nruns, objs.wide_runs);
+    else
+      p = read_array(p, header.nruns, objs.short_runs);
+    p = read_array(p, header.nobjs, objs.colors);
+    read_array(p, header.nobjs, objs.bounds);
+  }
+
+  munmap(map, size);
+  return valid;
+}
+
+// Written to a temporary file and renamed into place, so readers never
+// see a partial entry.
+void
+ObjCache::store(unsigned long long content_hash,
+                const std::vector<double> &params,
+                const ObjectSet &objs) const
+{
+  cache_header_t header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = OBJCACHE_VERSION;
+  header.wide = objs.wide;
+  header.word_size = sizeof(size_t);
+  header.nobjs = objs.size();
+  header.nruns = objs.wide ? objs.wide_runs.size() : objs.short_runs.size();
+
+  unsigned long long params_hash;
+  std::string path;
+  entry_path(content_hash, params, params_hash, path);
+  header.content_hash = content_hash;
+  header.params_hash = params_hash;
+
+  std::string tmp_path = path + ".XXXXXX";
+  std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+  tmp_name.push_back('\0');
+  int fd = mkstemp(&tmp_name[0]);
+  if (fd < 0)
+    return;
+  FILE *out = fdopen(fd, "wb");
+  if (! out) {
+    close(fd);
+    unlink(&tmp_name[0]);
+    return;
+  }
+
+  bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+    write_array(out, objs.offsets) &&
+    write_array(out, objs.counts) &&
+    write_array(out, objs.areas) &&
+    (objs.wide ? write_array(out, objs.wide_runs)
+               : write_array(out, objs.short_runs)) &&
+    write_array(out, objs.colors) &&
+    write_array(out, objs.bounds);
+  ok = (std::fclose(out) == 0) && ok;
+
+  if (! ok || std::rename(&tmp_name[0], path.c_str()) != 0)
+    unlink(&tmp_name[0]);
+}
@@ -0,0 +1,47 @@
+#ifndef OBJCACHE_INCLUDED
+#define OBJCACHE_INCLUDED 1
+
+#include <string>
+#include <vector>
+
+#include "objfind.h"
+
+// Bump whenever the entry format changes, or objfind changes in a way
+// labeler_signature() doesn't describe, so entries written by older code
+// are ignored.
+static const unsigned int OBJCACHE_VERSION = 1;
+
+// Sorted objects kept on disk, one file per image, params, labeler and
+// code version.  Entries are keyed on a hash of the image file's contents
+// rather than its name or time, so an edited image misses and a renamed
+// one still hits.  labeler, such as labeler_signature(), is hashed into
+// every key, so objects found by a labeler set up differently miss
+// instead of coming back stale.  The cache is best effort: anything that
+// can't be read or written is a miss.  One cache may be shared between
+// threads.
+class ObjCache
+{
+public:
+  explicit ObjCache(const std::string &labeler,
+                    const std::string &dir = ".objcache");
+
+  // The hash of an image file's contents that keys its entries.  It's
+  // taken once per file and passed to every load and store for it.
+  static unsigned long long content_hash(const void *data, size_t size);
+
+  // Fills objs from the cache, returning false on a miss.
+  bool load(unsigned long long content_hash,
+            const std::vector<double> &params, ObjectSet &objs) const;
+  void store(unsigned long long content_hash,
+             const std::vector<double> &params, const ObjectSet &objs) const;
+
+private:
+  std::string dir;
+  unsigned long long labeler_hash;
+
+  void entry_path(unsigned long long content_hash,
+                  const std::vector<double> &params,
+                  unsigned long long &params_hash, std::string &path) const;
+};
+
+#endif  // OBJCACHE_INCLUDED
@@ -1,148 +1,532 @@
 #include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <limits>
 #include <list>
+#include <string>
 #include <vector>
 
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OBJFIND_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 #define CV_NO_BACKWARD_COMPATIBILITY
 #include <opencv/cv.h>
 
+#include "instrument.h"
 #include "objfind.h"
 
 //namespace objfind {
 
 struct RunNode : public RunBase {
-  std::vector<size_t> adjacent;
   size_t group;
   unsigned int flags;
   int color;
 };
 
-static size_t
-connect_run_to_graph(RunBase &run, int color,
-                     std::vector<RunNode> &graph,
-                     const std::vector<size_t> &last_row_objs)
+// The run graph in compressed sparse row form.  The runs in the row
+// above nodes[i] that touch it are edges[offsets[i]] up to (but not
+// including) edges[offsets[i + 1]].
+struct RunGraph {
+  std::vector<RunNode> nodes;
+  std::vector<size_t> offsets;
+  std::vector<size_t> edges;
+
+  size_t size() const { return nodes.size(); }
+  RunNode &operator [](size_t i) { return nodes[i]; }
+};
+
+// Row scanners store the x of every pixel that differs from its left
+// neighbour, which is where one run ends and the next starts, and return
+// how many there are.  The vector versions compare 16 or 32 pixels with
+// their left neighbours at once and turn the mismatch mask into
+// positions with a bit scan; the rest of the row is done one at a time.
+static int
+scan_row_from(const uchar *row, int x, int cols, int *ends)
+{
+  int n = 0;
+  for ( ; x < cols; ++x) {
+    if (row[x] != row[x - 1])
+      ends[n++] = x;
+  }
+  return n;
+}
+
+static int
+scan_row_scalar(const uchar *row, int cols, int *ends)
 {
-  graph.push_back(RunNode());
-  RunNode &node = graph.back();
+  return scan_row_from(row, 1, cols, ends);
+}
+
+#ifdef OBJFIND_X86_SIMD
+
+__attribute__((target("sse2")))
+static int
+scan_row_sse2(const uchar *row, int cols, int *ends)
+{
+  int n = 0;
+  int x = 1;
+  for ( ; x + 16 <= cols; x += 16) {
+    __m128i cur = _mm_loadu_si128((const __m128i *) (row + x));
+    __m128i left = _mm_loadu_si128((const __m128i *) (row + x - 1));
+    unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(cur, left));
+    mask &= 0xffff;
+    for ( ; mask; mask &= mask - 1)
+      ends[n++] = x + __builtin_ctz(mask);
+  }
+  return n + scan_row_from(row, x, cols, ends + n);
+}
+
+__attribute__((target("avx2")))
+static int
+scan_row_avx2(const uchar *row, int cols, int *ends)
+{
+  int n = 0;
+  int x = 1;
+  for ( ; x + 32 <= cols; x += 32) {
+    __m256i cur = _mm256_loadu_si256((const __m256i *) (row + x));
+    __m256i left = _mm256_loadu_si256((const __m256i *) (row + x - 1));
+    unsigned int mask = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(cur, left));
+    for ( ; mask; mask &= mask - 1)
+      ends[n++] = x + __builtin_ctz(mask);
+  }
+  return n + scan_row_from(row, x, cols, ends + n);
+}
+
+#endif  // OBJFIND_X86_SIMD
+
+row_scanner_t
+find_row_scanner(const char *isa)
+{
+  std::string name = isa ? isa : "";
+#ifdef OBJFIND_X86_SIMD
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool sse2 = __builtin_cpu_supports("sse2");
+  if ((name.empty() || name == "avx2") && avx2)
+    return scan_row_avx2;
+  if ((name.empty() || name == "sse2") && sse2)
+    return scan_row_sse2;
+#endif
+  if (name.empty() || name == "scalar")
+    return scan_row_scalar;
+  return 0;
+}
+
+static row_scanner_t
+row_scanner()
+{
+  static row_scanner_t scanner = find_row_scanner(0);
+  return scanner;
+}
+
+// Stores where each run in a row ends but the last, as a row scanner
+// does.  A run ends at the first pixel that doesn't match its first.
+template<typename Pixel, typename Same>
+struct RunEnds {
+  static int scan(const uchar *row, int cols, const Same &same, int *ends)
+  {
+    int n = 0;
+    int first = Pixel::color(row, 0);
+    for (int x = 1; x < cols; ++x) {
+      int color = Pixel::color(row, x);
+      if (! same(first, color)) {
+        ends[n++] = x;
+        first = color;
+      }
+    }
+    return n;
+  }
+};
+
+template<>
+struct RunEnds<Gray8, SameColor> {
+  static int scan(const uchar *row, int cols, const SameColor &, int *ends)
+  {
+    return row_scanner()(row, cols, ends);
+  }
+};
+
+// Runs in a row tile it from left to right, so the runs above that can
+// touch a run start at *above and stop at the first run that starts at
+// or after its end, or just after it for 8-connectivity, which also
+// counts runs touching diagonally.  *above is left on the first run
+// that may still touch the next run in the same row.
+template<int Connectivity, typename Same>
+static void
+connect_to_row_above(const RunNode &node, const Same &same, RunGraph &graph,
+                     size_t *above, size_t above_end)
+{
+  const int reach = Connectivity == 8 ? 1 : 0;
+  while (*above < above_end && graph.nodes[*above].end + reach <= node.start)
+    ++*above;
+
+  for (size_t i = *above; i < above_end; ++i) {
+    const RunNode &other = graph.nodes[i];
+    assert(other.row == node.row - 1);
+    if (node.end + reach <= other.start)
+      break;
+    if (same(other.color, node.color))
+      graph.edges.push_back(i);
+  }
+}
+
+template<int Connectivity, typename Same>
+static void
+connect_run_to_graph(RunBase &run, int color, const Same &same,
+                     RunGraph &graph, size_t *above, size_t above_end)
+{
+  graph.offsets.push_back(graph.edges.size());
+  graph.nodes.push_back(RunNode());
+  RunNode &node = graph.nodes.back();
   node.row = run.row;
   node.start = run.start;
   node.end = run.end;
   node.color = color;
   node.flags = 0;
 
-  for (size_t i = 0; i < last_row_objs.size(); ++i) {
-    RunNode &other = graph[last_row_objs[i]];
-    assert(other.row == node.row - 1);
-    if (other.color != color)
-      continue;
-    if (std::max(node.start, other.start) < std::min(node.end, other.end))
-      node.adjacent.push_back(last_row_objs[i]);
-  }
+  connect_to_row_above<Connectivity>(node, same, graph, above, above_end);
+}
 
-  return graph.size() - 1;
+static void
+connect_run_to_graph(RunBase &run, int color, RunGraph &graph,
+                     size_t *above, size_t above_end)
+{
+  connect_run_to_graph<4>(run, color, SameColor(), graph, above, above_end);
 }
 
+// Runs are numbered from first_row, so a band of a larger image can be
+// given its own graph.
+template<int Connectivity, typename Pixel, typename Same>
 static void
-objfind_generate_run_graph(const cv::Mat &img,
-                           std::vector<RunNode> &graph)
+generate_run_graph(const cv::Mat &img, int first_row, const Same &same,
+                   RunGraph &graph)
 {
-  assert(img.type() == CV_8UC1);
+  assert(img.depth() == CV_8U && img.channels() == Pixel::channels);
 
-  std::vector<size_t> last_row_objs;
-  std::vector<size_t> cur_row_objs;
+  std::vector<int> ends(img.cols);
+  size_t last_row_begin = 0;
+  size_t last_row_end = 0;
 
   for (int y = 0; y < img.rows; ++y) {
     const uchar *row = img.ptr(y);
+    size_t above = last_row_begin;
+    size_t row_begin = graph.size();
+    int nends = RunEnds<Pixel, Same>::scan(row, img.cols, same, &ends[0]);
+    ends[nends++] = img.cols;
+
     RunBase run;
-    run.row = y;
+    run.row = first_row + y;
     run.start = 0;
-    int color = row[0];
+    for (int i = 0; i < nends; ++i) {
+      run.end = ends[i];
+      connect_run_to_graph<Connectivity>(run, Pixel::color(row, run.start),
+                                         same, graph, &above, last_row_end);
+      run.start = run.end;
+    }
 
-    for (int x = 0; x < img.cols; ++x) {
-      int xcolor = row[x];
-      if (xcolor != color) {
-        run.end = x;
+    last_row_begin = row_begin;
+    last_row_end = graph.size();
+  }
 
-        size_t id = connect_run_to_graph(run, color, graph, last_row_objs);
-        cur_row_objs.push_back(id);
+  graph.offsets.push_back(graph.edges.size());
+}
 
-        run.start = x;
-        color = xcolor;
-      }
-    }
-    run.end = img.cols;
+static void
+objfind_generate_run_graph(const cv::Mat &img, int first_row,
+                           RunGraph &graph)
+{
+  generate_run_graph<4, Gray8>(img, first_row, SameColor(), graph);
+}
 
-    size_t id = connect_run_to_graph(run, color, graph, last_row_objs);
-    cur_row_objs.push_back(id);
+// Disjoint-set forest over run indices.  Path compression plus union
+// by rank keeps every operation effectively constant time, so grouping
+// scales with the number of runs instead of runs times merges.
+class RunSets
+{
+public:
+  explicit RunSets(size_t n)
+    : parent(n), rank(n, 0), merges(0)
+  {
+    for (size_t i = 0; i < n; ++i)
+      parent[i] = i;
+  }
 
-    last_row_objs.swap(cur_row_objs);
-    cur_row_objs.clear();
+  size_t find(size_t x)
+  {
+    size_t root = x;
+    while (parent[root] != root)
+      root = parent[root];
+    while (parent[x] != root) {
+      size_t next = parent[x];
+      parent[x] = root;
+      x = next;
+    }
+    return root;
   }
-}
 
+  void join(size_t a, size_t b)
+  {
+    a = find(a);
+    b = find(b);
+    if (a == b)
+      return;
+    ++merges;
+    if (rank[a] < rank[b])
+      std::swap(a, b);
+    parent[b] = a;
+    if (rank[a] == rank[b])
+      ++rank[a];
+  }
+
+  size_t merge_count() const { return merges; }
+
+private:
+  std::vector<size_t> parent;
+  std::vector<unsigned char> rank;
+  size_t merges;
+};
+
+// Walk upward from every run that has nothing below it, marking the runs
+// it reaches.  A run is RUN_TOP if nothing is above it, and a bottom run
+// is RUN_BOTTOM if its walk reaches nothing an earlier walk already
+// claimed.  Walks go from the last run to the first and use an explicit
+// stack, so tall regions can't overflow the call stack.
 static void
-patch_group(std::vector<RunNode> &graph, size_t old_group, size_t new_group)
+define_objects(RunGraph &graph)
 {
-  for (size_t i = 0; i < graph.size(); ++i) {
-    RunNode &node = graph[i];
-    if (node.group == old_group)
-      node.group = new_group;
+  RunSets sets(graph.size());
+  std::vector<size_t> stack;
+
+  for (size_t i = graph.size(); 0 < i; --i) {
+    RunNode &bottom = graph[i - 1];
+    if (bottom.flags & RUN_GROUPED)
+      continue;
+
+    // Runs claimed by this walk have their group set to the walk's
+    // starting run until the final pass below.
+    size_t walk = i - 1;
+    bool fresh = true;
+    bottom.flags |= RUN_GROUPED;
+    bottom.group = walk;
+    stack.push_back(walk);
+
+    while (! stack.empty()) {
+      size_t id = stack.back();
+      stack.pop_back();
+      size_t first = graph.offsets[id];
+      size_t last = graph.offsets[id + 1];
+      if (first == last)
+        graph[id].flags |= RUN_TOP;
+
+      for (size_t e = first; e < last; ++e) {
+        size_t adj_id = graph.edges[e];
+        RunNode &adj = graph[adj_id];
+        sets.join(id, adj_id);
+        if (adj.flags & RUN_GROUPED) {
+          if (adj.group != walk)
+            fresh = false;
+          continue;
+        }
+        adj.flags |= RUN_GROUPED;
+        adj.group = walk;
+        stack.push_back(adj_id);
+      }
+    }
+
+    if (fresh)
+      bottom.flags |= RUN_BOTTOM;
   }
+
+  for (size_t i = 0; i < graph.size(); ++i)
+    graph[i].group = sets.find(i);
+  profile_count("merges", sets.merge_count());
 }
 
-static size_t
-find_or_assign_group(RunNode &node, std::vector<RunNode> &graph,
-                     size_t new_group)
+ObjFilter::ObjFilter()
+  : min_area(0), max_area(std::numeric_limits<size_t>::max()),
+    min_width(0), max_width(std::numeric_limits<int>::max()),
+    min_height(0), max_height(std::numeric_limits<int>::max()),
+    min_aspect(0.), max_aspect(std::numeric_limits<double>::infinity()),
+    top_k(0)
+{ }
+
+bool
+ObjFilter::keeps_all() const
+{
+  ObjFilter all;
+  return min_area == all.min_area && max_area == all.max_area &&
+    min_width == all.min_width && max_width == all.max_width &&
+    min_height == all.min_height && max_height == all.max_height &&
+    min_aspect == all.min_aspect && max_aspect == all.max_aspect &&
+    ignore_colors.empty() && top_k == 0;
+}
+
+bool
+ObjFilter::accepts(size_t area, const cv::Rect &bound, int color) const
+{
+  if (area < min_area || max_area < area ||
+      bound.width < min_width || max_width < bound.width ||
+      bound.height < min_height || max_height < bound.height)
+    return false;
+  double aspect = static_cast<double>(bound.height) / bound.width;
+  if (aspect < min_aspect || max_aspect < aspect)
+    return false;
+  return std::find(ignore_colors.begin(), ignore_colors.end(), color) ==
+    ignore_colors.end();
+}
+
+// Larger area first, then lower index, so the top k are always the same.
+struct top_area_comparator {
+  const std::vector<size_t> *areas;
+
+  bool operator ()(size_t i1, size_t i2) const
+  {
+    size_t a1 = (*areas)[i1];
+    size_t a2 = (*areas)[i2];
+    return a2 < a1 || (a1 == a2 && i1 < i2);
+  }
+};
+
+// Drops the objects filter rejects from the per-object arrays, keeping
+// the rest in order.  renumber[id] is the new number of object id, or
+// none if it was dropped.
+static void
+filter_objects(const ObjFilter &filter, ObjectSet &objs,
+               std::vector<size_t> &renumber)
 {
-  if (node.flags & RUN_GROUPED)
-    return node.group;
+  const size_t none = std::numeric_limits<size_t>::max();
+  bool moments = objs.moments.size() == objs.size();
+  renumber.assign(objs.size(), none);
 
-  if (node.adjacent.empty()) {
-    node.flags |= (RUN_TOP | RUN_GROUPED);
-    return node.group = new_group;
+  std::vector<size_t> top;
+  if (filter.top_k != 0) {
+    for (size_t id = 0; id < objs.size(); ++id) {
+      if (filter.accepts(objs.areas[id], objs.bounds[id], objs.colors[id]))
+        top.push_back(id);
+    }
+    if (filter.top_k < top.size()) {
+      top_area_comparator comparator;
+      comparator.areas = &objs.areas;
+      std::nth_element(top.begin(), top.begin() + filter.top_k, top.end(),
+                       comparator);
+      top.resize(filter.top_k);
+    }
+    for (size_t i = 0; i < top.size(); ++i)
+      renumber[top[i]] = 0;
   }
 
-  for (size_t i = node.adjacent.size(); 0 < i; --i) {
-    RunNode &adj = graph[node.adjacent[i - 1]];
-    size_t group = find_or_assign_group(adj, graph, new_group);
-    if (i < node.adjacent.size() && new_group != group)
-      patch_group(graph, new_group, group);
-    new_group = group;
+  size_t n = 0;
+  for (size_t id = 0; id < objs.size(); ++id) {
+    bool keep = filter.top_k != 0 ? renumber[id] != none :
+      filter.accepts(objs.areas[id], objs.bounds[id], objs.colors[id]);
+    if (! keep)
+      continue;
+    renumber[id] = n;
+    objs.counts[n] = objs.counts[id];
+    objs.areas[n] = objs.areas[id];
+    objs.colors[n] = objs.colors[id];
+    objs.bounds[n] = objs.bounds[id];
+    if (moments)
+      objs.moments[n] = objs.moments[id];
+    ++n;
   }
+  objs.counts.resize(n);
+  objs.areas.resize(n);
+  objs.colors.resize(n);
+  objs.bounds.resize(n);
+  if (moments)
+    objs.moments.resize(n);
+}
 
-  node.flags |= RUN_GROUPED;
-  return node.group = new_group;
+static bool
+stream_run_comparator(const RunBase &r1, const RunBase &r2)
+{
+  return r1.row < r2.row || (r1.row == r2.row && r1.start < r2.start);
 }
 
+// Column sums over the run use the closed forms for sums of consecutive
+// integers and of their squares.
 static void
-define_objects(std::vector<RunNode> &graph)
+add_run_moments(ObjMoments &m, const RunBase &run)
 {
-  size_t next_group = 0;
-  for (size_t i = graph.size(); 0 < i; --i) {
-    RunNode &node = graph[i - 1];
-    size_t group = find_or_assign_group(node, graph, next_group);
-    if (group == next_group) {
-      node.flags |= RUN_BOTTOM;
-      ++next_group;
+  double n = run.end - run.start;
+  double y = run.row;
+  double first = run.start;
+  double last = run.end - 1;
+  double sx = n * (first + last) / 2.;
+  double sxx = (last * (last + 1.) * (2. * last + 1.) -
+                (first - 1.) * first * (2. * first - 1.)) / 6.;
+  m.m00 += n;
+  m.m10 += sx;
+  m.m01 += n * y;
+  m.m20 += sxx;
+  m.m11 += y * sx;
+  m.m02 += n * y * y;
+  ++m.runs;
+  m.perimeter += 2 * (run.end - run.start) + 2;
+}
+
+// Touching runs in neighbouring rows share the edges along their overlap,
+// which is empty if they only touch at a corner.
+static void
+add_link_moments(ObjMoments &m, const RunBase &run, const RunBase &above)
+{
+  ++m.links;
+  int overlap = std::min(run.end, above.end) -
+    std::max(run.start, above.start);
+  if (0 < overlap)
+    m.perimeter -= 2 * overlap;
+}
+
+// For objects that don't come from a run graph, runs in neighbouring
+// rows are linked when they overlap, as with 4-connectivity.
+static ObjMoments
+moments_of_runs(std::vector<Run> runs)
+{
+  std::sort(runs.begin(), runs.end(), stream_run_comparator);
+  ObjMoments m;
+  size_t above_begin = 0;
+  size_t above_end = 0;
+  size_t row_begin = 0;
+  for (size_t i = 0; i < runs.size(); ++i) {
+    if (0 < i && runs[i].row != runs[i - 1].row) {
+      bool next_row = runs[i].row == runs[i - 1].row + 1;
+      above_begin = next_row ? row_begin : i;
+      above_end = i;
+      row_begin = i;
+    }
+    add_run_moments(m, runs[i]);
+    for (size_t j = above_begin; j < above_end; ++j) {
+      if (runs[j].start < runs[i].end && runs[i].start < runs[j].end)
+        add_link_moments(m, runs[i], runs[j]);
     }
   }
+  return m;
 }
 
 static void
-fix_area_and_bound(Obj &obj, const Run &run)
+fix_area_and_bound(size_t &area, cv::Rect &bound, const RunBase &run)
 {
-  obj.area += run.end - run.start;
-  int xend = obj.bound.x + obj.bound.width;
-  obj.bound.x = std::min(obj.bound.x, run.start);
-  obj.bound.width = std::max(xend, run.end) - obj.bound.x;
-  int yend = obj.bound.y + obj.bound.height;
-  obj.bound.y = std::min(obj.bound.y, run.row);
-  obj.bound.height = std::max(yend, run.row + 1) - obj.bound.y;
+  area += run.end - run.start;
+  int xend = bound.x + bound.width;
+  bound.x = std::min(bound.x, run.start);
+  bound.width = std::max(xend, run.end) - bound.x;
+  int yend = bound.y + bound.height;
+  bound.y = std::min(bound.y, run.row);
+  bound.height = std::max(yend, run.row + 1) - bound.y;
 }
 
+// Objects are numbered in order of their first run, and their runs are
+// laid out in graph order.  The first pass numbers objects and sizes
+// them; the filter then drops objects, and the second pass places each
+// kept run in its object's slice of the buffer.
 static void
-extract_objects(std::vector<RunNode> &graph, std::vector<Obj> &objs)
+extract_objects(RunGraph &graph, bool wide, const ObjFilter &filter,
+                ObjectSet &objs)
 {
   const int maxint = std::numeric_limits<int>::max();
   assert(maxint + (-maxint) == 0);
@@ -152,62 +536,1075 @@ extract_objects(std::vector<RunNode> &graph, std::vector<Obj> &objs)
   init_bound.width = -maxint;
   init_bound.height = -maxint;
 
-  typedef std::map<size_t, size_t> table_t;
-  table_t table;
-  Run run;
-  Obj *obj;
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::vector<size_t> table(graph.size(), none);
+
+  for (size_t i = 0; i < graph.size(); ++i) {
+    RunNode &node = graph[i];
+    size_t &id = table[node.group];
+    if (id == none) {
+      id = objs.size();
+      objs.counts.push_back(0);
+      objs.areas.push_back(0);
+      objs.colors.push_back(node.color);
+      objs.bounds.push_back(init_bound);
+      if (objs.track_moments)
+        objs.moments.push_back(ObjMoments());
+    }
+    ++objs.counts[id];
+    fix_area_and_bound(objs.areas[id], objs.bounds[id], node);
+    if (objs.track_moments) {
+      ObjMoments &m = objs.moments[id];
+      add_run_moments(m, node);
+      for (size_t e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e)
+        add_link_moments(m, node, graph[graph.edges[e]]);
+    }
+  }
+
+  bool filtering = ! filter.keeps_all();
+  std::vector<size_t> renumber;
+  if (filtering)
+    filter_objects(filter, objs, renumber);
+
+  objs.wide = wide;
+  objs.offsets.resize(objs.size());
+  size_t offset = 0;
+  for (size_t id = 0; id < objs.size(); ++id) {
+    objs.offsets[id] = offset;
+    offset += objs.counts[id];
+  }
+
+  if (wide)
+    objs.wide_runs.resize(offset);
+  else
+    objs.short_runs.resize(offset);
+
+  std::vector<size_t> next(objs.offsets);
+  for (size_t i = 0; i < graph.size(); ++i) {
+    RunNode &node = graph[i];
+    size_t id = table[node.group];
+    if (filtering && (id = renumber[id]) == none)
+      continue;
+    size_t at = next[id]++;
+    unsigned int flags = node.flags & (RUN_TOP | RUN_BOTTOM);
+    if (wide) {
+      Run &run = objs.wide_runs[at];
+      run.row = node.row;
+      run.start = node.start;
+      run.end = node.end;
+      run.flags = flags;
+    } else {
+      ShortRun &run = objs.short_runs[at];
+      run.row = node.row;
+      run.start = node.start;
+      run.end = node.end;
+      run.flags = flags;
+    }
+  }
+}
+
+void
+ObjectSet::clear()
+{
+  wide = false;
+  short_runs.clear();
+  wide_runs.clear();
+  offsets.clear();
+  counts.clear();
+  areas.clear();
+  colors.clear();
+  bounds.clear();
+  moments.clear();
+}
+
+void
+ObjectSet::push_back(const Obj &obj)
+{
+  offsets.push_back(wide ? wide_runs.size() : short_runs.size());
+  counts.push_back(obj.runs.size());
+  areas.push_back(obj.area);
+  colors.push_back(obj.color);
+  bounds.push_back(obj.bound);
+  if (track_moments)
+    moments.push_back(moments_of_runs(obj.runs));
+
+  for (size_t i = 0; i < obj.runs.size(); ++i) {
+    const Run &run = obj.runs[i];
+    if (wide)
+      wide_runs.push_back(run);
+    else {
+      const int maxshort = std::numeric_limits<ushort>::max();
+      assert(run.end <= maxshort && run.row < maxshort);
+      ShortRun sr;
+      sr.row = run.row;
+      sr.start = run.start;
+      sr.end = run.end;
+      sr.flags = run.flags;
+      short_runs.push_back(sr);
+    }
+  }
+}
+
+// Runs of one row of an image whose pixels are map applied to fine's,
+// starting at fine.runs[*i].  Neighbouring runs that map to the same
+// color are joined.  *i is left on the next row's first run.
+static void
+remap_row(const RunRows &fine, const uchar *map, size_t *i,
+          RunGraph &graph, size_t *above, size_t above_end)
+{
+  const std::vector<RunBase> &runs = fine.runs;
+  int row = runs[*i].row;
+  while (*i < runs.size() && runs[*i].row == row) {
+    RunBase run = runs[*i];
+    uchar color = map[fine.colors[*i]];
+    for (++*i; *i < runs.size() && runs[*i].row == row &&
+           map[fine.colors[*i]] == color; ++*i)
+      run.end = runs[*i].end;
+    connect_run_to_graph(run, color, graph, above, above_end);
+  }
+}
+
+static void
+objfind_remapped_run_graph(const RunRows &fine, const uchar *map,
+                           RunGraph &graph)
+{
+  graph.nodes.reserve(fine.runs.size());
+  graph.offsets.reserve(fine.runs.size() + 1);
+  size_t last_row_begin = 0;
+  size_t last_row_end = 0;
+  size_t i = 0;
+  while (i < fine.runs.size()) {
+    size_t above = last_row_begin;
+    size_t row_begin = graph.size();
+    remap_row(fine, map, &i, graph, &above, last_row_end);
+    last_row_begin = row_begin;
+    last_row_end = graph.size();
+  }
+  graph.offsets.push_back(graph.edges.size());
+}
+
+static void
+keep_runs(const RunGraph &graph, int rows, int cols, RunRows &kept)
+{
+  kept.rows = rows;
+  kept.cols = cols;
+  kept.runs.resize(graph.size());
+  kept.colors.resize(graph.size());
+  for (size_t i = 0; i < graph.size(); ++i) {
+    kept.runs[i] = graph.nodes[i];
+    kept.colors[i] = graph.nodes[i].color;
+  }
+}
+
+// Groups the runs of the whole image's graph into the objs that filter
+// keeps.
+static void
+objects_from_graph(RunGraph &graph, int rows, int cols, ObjectSet &objs,
+                   const ObjFilter &filter = ObjFilter())
+{
+  profile_count("runs", graph.size());
+  profile_count("edges", graph.edges.size());
+  profile_bytes("objfind.graph",
+                graph.nodes.capacity() * sizeof(RunNode) +
+                (graph.offsets.capacity() + graph.edges.capacity()) *
+                sizeof(size_t));
+
+  {
+    StageTimer timer("objfind.group");
+    define_objects(graph);
+  }
+
+  const int maxshort = std::numeric_limits<ushort>::max();
+  bool wide = maxshort < cols || maxshort < rows;
+
+  assert(objs.empty());
+  StageTimer timer("objfind.extract");
+  extract_objects(graph, wide, filter, objs);
+  profile_count("objects", objs.size());
+  size_t nruns = wide ? objs.wide_runs.size() : objs.short_runs.size();
+  profile_bytes("objfind.extract",
+                graph.size() * sizeof(size_t) +
+                nruns * (wide ? sizeof(Run) : sizeof(ShortRun)) +
+                objs.size() * (3 * sizeof(size_t) + sizeof(int) +
+                               sizeof(cv::Rect)));
+}
+
+void
+objfind(const cv::Mat &img, ObjectSet &objs)
+{
+  objfind(img, objs, 0);
+}
+
+void
+objfind(const cv::Mat &img, ObjectSet &objs, const ObjFilter &filter)
+{
+  assert(img.depth() == CV_8U);
+
+  RunGraph graph;
+  {
+    StageTimer timer("objfind.graph");
+    objfind_generate_run_graph(img, 0, graph);
+  }
+  objects_from_graph(graph, img.rows, img.cols, objs, filter);
+}
+
+void
+objfind(const cv::Mat &img, ObjectSet &objs, RunRows *rows)
+{
+  assert(img.depth() == CV_8U);
+
+  RunGraph graph;
+  {
+    StageTimer timer("objfind.graph");
+    objfind_generate_run_graph(img, 0, graph);
+  }
+  if (rows)
+    keep_runs(graph, img.rows, img.cols, *rows);
+  objects_from_graph(graph, img.rows, img.cols, objs);
+}
+
+template<int Connectivity, typename Pixel, typename Same>
+void
+objfind_with(const cv::Mat &img, ObjectSet &objs, const Same &same)
+{
+  RunGraph graph;
+  {
+    StageTimer timer("objfind.graph");
+    generate_run_graph<Connectivity, Pixel>(img, 0, same, graph);
+  }
+  objects_from_graph(graph, img.rows, img.cols, objs);
+}
 
+template void
+objfind_with<4, Gray8>(const cv::Mat &, ObjectSet &, const SameColor &);
+template void
+objfind_with<8, Gray8>(const cv::Mat &, ObjectSet &, const SameColor &);
+template void
+objfind_with<4, Gray8>(const cv::Mat &, ObjectSet &, const NearColor &);
+template void
+objfind_with<8, Gray8>(const cv::Mat &, ObjectSet &, const NearColor &);
+template void
+objfind_with<4, Bgr8>(const cv::Mat &, ObjectSet &, const SameColor &);
+template void
+objfind_with<8, Bgr8>(const cv::Mat &, ObjectSet &, const SameColor &);
+template void
+objfind_with<4, Bgr8>(const cv::Mat &, ObjectSet &, const NearColor &);
+template void
+objfind_with<8, Bgr8>(const cv::Mat &, ObjectSet &, const NearColor &);
+
+void
+objfind_remapped(const RunRows &fine, const uchar *map, ObjectSet &objs,
+                 RunRows *rows)
+{
+  RunGraph graph;
+  {
+    StageTimer timer("objfind.remap");
+    objfind_remapped_run_graph(fine, map, graph);
+  }
+  if (rows)
+    keep_runs(graph, fine.rows, fine.cols, *rows);
+  objects_from_graph(graph, fine.rows, fine.cols, objs);
+}
+
+// One horizontal tile of an image labeled by objfind_parallel.  Its
+// runs are grouped into components on its own thread, numbered in order
+// of their first run, with each component's sums kept as extract_objects
+// keeps an object's.
+struct tile_job_t {
+  const cv::Mat *img;
+  int first_row;
+  int rows;
+  bool track_moments;
+  RunGraph graph;
+  size_t merges;
+
+  // Component of each run, and each component's sums.
+  std::vector<size_t> comps;
+  std::vector<size_t> counts;
+  std::vector<size_t> areas;
+  std::vector<int> colors;
+  std::vector<cv::Rect> bounds;
+  std::vector<ObjMoments> moments;
+
+  // The runs of the tile's first row that touch the tile above.  The
+  // runs above first_row_runs[i] are seam_edges[seam_offsets[i]] up to
+  // seam_edges[seam_offsets[i + 1]], numbered in the whole image.
+  size_t base;
+  size_t first_row_runs;
+  std::vector<size_t> seam_offsets;
+  std::vector<size_t> seam_edges;
+
+  // Where the next run of each object the tile has a part of goes in
+  // objs, and which of those each component is in, or none if its object
+  // was dropped.  Set once objects are numbered.
+  ObjectSet *objs;
+  std::vector<size_t> parts;
+  std::vector<size_t> next;
+};
+
+static void *
+label_tile(void *ptr)
+{
+  tile_job_t *job = static_cast<tile_job_t *>(ptr);
+  cv::Mat tile(*job->img, cv::Rect(0, job->first_row,
+                                   job->img->cols, job->rows));
+  RunGraph &graph = job->graph;
+  objfind_generate_run_graph(tile, job->first_row, graph);
+
+  RunSets sets(graph.size());
+  for (size_t i = 0; i < graph.size(); ++i) {
+    for (size_t e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e)
+      sets.join(i, graph.edges[e]);
+  }
+  job->merges = sets.merge_count();
+
+  const int maxint = std::numeric_limits<int>::max();
+  cv::Rect init_bound(maxint, maxint, -maxint, -maxint);
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::vector<size_t> table(graph.size(), none);
+  job->comps.resize(graph.size());
   for (size_t i = 0; i < graph.size(); ++i) {
     RunNode &node = graph[i];
+    size_t &c = table[sets.find(i)];
+    if (c == none) {
+      c = job->counts.size();
+      job->counts.push_back(0);
+      job->areas.push_back(0);
+      job->colors.push_back(node.color);
+      job->bounds.push_back(init_bound);
+      if (job->track_moments)
+        job->moments.push_back(ObjMoments());
+    }
+    job->comps[i] = c;
+    ++job->counts[c];
+    fix_area_and_bound(job->areas[c], job->bounds[c], node);
+
+    size_t first = graph.offsets[i];
+    size_t last = graph.offsets[i + 1];
+    node.flags = first == last ? RUN_TOP : 0;
+    if (job->track_moments) {
+      ObjMoments &m = job->moments[c];
+      add_run_moments(m, node);
+      for (size_t e = first; e < last; ++e)
+        add_link_moments(m, node, graph[graph.edges[e]]);
+    }
+  }
+  return 0;
+}
+
+// Places the runs of the tile's kept components in their objects.
+static void *
+copy_tile_runs(void *ptr)
+{
+  tile_job_t *job = static_cast<tile_job_t *>(ptr);
+  const size_t none = std::numeric_limits<size_t>::max();
+  ObjectSet &objs = *job->objs;
+  for (size_t i = 0; i < job->graph.size(); ++i) {
+    const RunNode &node = job->graph[i];
+    size_t part = job->parts[job->comps[i]];
+    if (part == none)
+      continue;
+    size_t at = job->next[part]++;
+    unsigned int flags = node.flags & (RUN_TOP | RUN_BOTTOM);
+    if (objs.wide) {
+      Run &run = objs.wide_runs[at];
+      run.row = node.row;
+      run.start = node.start;
+      run.end = node.end;
+      run.flags = flags;
+    } else {
+      ShortRun &run = objs.short_runs[at];
+      run.row = node.row;
+      run.start = node.start;
+      run.end = node.end;
+      run.flags = flags;
+    }
+  }
+  return 0;
+}
+
+// Runs fn on every job, each on its own thread, or on this one if a
+// thread can't be started.
+static void
+run_tile_jobs(std::vector<tile_job_t> &jobs, void *(*fn)(void *))
+{
+  std::vector<pthread_t> threads(jobs.size());
+  std::vector<bool> started(jobs.size());
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    started[t] = pthread_create(&threads[t], 0, fn, &jobs[t]) == 0;
+    if (! started[t])
+      fn(&jobs[t]);
+  }
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    if (started[t])
+      pthread_join(threads[t], 0);
+  }
+}
+
+static void
+add_moments(ObjMoments &into, const ObjMoments &from)
+{
+  into.m00 += from.m00;
+  into.m10 += from.m10;
+  into.m01 += from.m01;
+  into.m20 += from.m20;
+  into.m11 += from.m11;
+  into.m02 += from.m02;
+  into.runs += from.runs;
+  into.links += from.links;
+  into.perimeter += from.perimeter;
+}
+
+// Finds the edges between the last row of upper and the first row of
+// lower, clearing RUN_TOP on the runs they leave, and joins the
+// components they connect.  comp_base is each tile's first component in
+// sets.
+static void
+stitch_seam(tile_job_t &upper, tile_job_t &lower,
+            const std::vector<size_t> &comp_base, size_t t, RunSets &sets)
+{
+  const RunGraph &above = upper.graph;
+  RunGraph &below = lower.graph;
+  size_t above_end = above.size();
+  size_t above_begin = above_end;
+  int last_row = upper.first_row + upper.rows - 1;
+  while (0 < above_begin && above.nodes[above_begin - 1].row == last_row)
+    --above_begin;
+
+  size_t first_end = 0;
+  while (first_end < below.size() && below.nodes[first_end].row ==
+         lower.first_row)
+    ++first_end;
+  lower.first_row_runs = first_end;
+  lower.seam_offsets.reserve(first_end + 1);
+
+  size_t j = above_begin;
+  for (size_t i = 0; i < first_end; ++i) {
+    RunNode &node = below[i];
+    lower.seam_offsets.push_back(lower.seam_edges.size());
+    while (j < above_end && above.nodes[j].end <= node.start)
+      ++j;
+    for (size_t k = j; k < above_end; ++k) {
+      const RunNode &other = above.nodes[k];
+      if (node.end <= other.start)
+        break;
+      if (other.color != node.color)
+        continue;
+      lower.seam_edges.push_back(upper.base + k);
+      node.flags &= ~RUN_TOP;
+      sets.join(comp_base[t] + lower.comps[i],
+                comp_base[t - 1] + upper.comps[k]);
+      if (lower.track_moments)
+        add_link_moments(lower.moments[lower.comps[i]], node, other);
+    }
+  }
+  lower.seam_offsets.push_back(lower.seam_edges.size());
+}
+
+// The runs above run i of a tile, in the whole image's numbering.
+static void
+runs_above(const tile_job_t &job, size_t i, std::vector<size_t> &above)
+{
+  above.clear();
+  const RunGraph &graph = job.graph;
+  for (size_t e = graph.offsets[i]; e < graph.offsets[i + 1]; ++e)
+    above.push_back(job.base + graph.edges[e]);
+  if (i < job.first_row_runs) {
+    for (size_t e = job.seam_offsets[i]; e < job.seam_offsets[i + 1]; ++e)
+      above.push_back(job.seam_edges[e]);
+  }
+}
+
+// Sets RUN_BOTTOM as define_objects' walks would.  A run with nothing
+// below it starts a walk, which claims every run it reaches upward that
+// no later walk claimed, and its run is RUN_BOTTOM if it never meets a
+// claimed run.  So a run's owner, the first walk to reach it, is the
+// latest bottom run below it, and a walk met another exactly if one of
+// its runs touches a run above with another owner.  Both are found in
+// one pass from the last run to the first and one over the edges,
+// without walking.
+static void
+find_bottom_runs(std::vector<tile_job_t> &jobs, size_t nruns)
+{
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::vector<size_t> owner(nruns, none);
+  std::vector<bool> met(nruns, false);
+  std::vector<size_t> above;
+
+  for (size_t t = jobs.size(); 0 < t--; ) {
+    tile_job_t &job = jobs[t];
+    for (size_t i = job.graph.size(); 0 < i--; ) {
+      size_t id = job.base + i;
+      if (owner[id] == none)
+        owner[id] = id;
+      runs_above(job, i, above);
+      for (size_t e = 0; e < above.size(); ++e) {
+        size_t &up = owner[above[e]];
+        if (up == none || up < owner[id])
+          up = owner[id];
+      }
+    }
+  }
+
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    tile_job_t &job = jobs[t];
+    for (size_t i = 0; i < job.graph.size(); ++i) {
+      size_t id = job.base + i;
+      runs_above(job, i, above);
+      for (size_t e = 0; e < above.size(); ++e) {
+        if (owner[above[e]] != owner[id])
+          met[owner[id]] = true;
+      }
+    }
+  }
+
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    tile_job_t &job = jobs[t];
+    for (size_t i = 0; i < job.graph.size(); ++i) {
+      size_t id = job.base + i;
+      if (owner[id] == id && ! met[id])
+        job.graph[i].flags |= RUN_BOTTOM;
+    }
+  }
+}
+
+// Joins the tiles' components at the seams into objects numbered in
+// order of their first run, as extract_objects numbers them, with their
+// sums added up, then drops the ones filter rejects and lays out the
+// rest's runs.
+static void
+merge_tiles(std::vector<tile_job_t> &jobs, bool wide,
+            const ObjFilter &filter, ObjectSet &objs)
+{
+  std::vector<size_t> comp_base(jobs.size());
+  size_t ncomps = 0;
+  size_t nruns = 0;
+  size_t merges = 0;
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    comp_base[t] = ncomps;
+    ncomps += jobs[t].counts.size();
+    jobs[t].base = nruns;
+    nruns += jobs[t].graph.size();
+    merges += jobs[t].merges;
+    jobs[t].first_row_runs = 0;
+  }
+
+  RunSets sets(ncomps);
+  for (size_t t = 1; t < jobs.size(); ++t)
+    stitch_seam(jobs[t - 1], jobs[t], comp_base, t, sets);
+  profile_count("merges", merges + sets.merge_count());
+  find_bottom_runs(jobs, nruns);
+
+  const size_t none = std::numeric_limits<size_t>::max();
+  std::vector<size_t> table(ncomps, none);
+  std::vector<size_t> ids(ncomps);
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    tile_job_t &job = jobs[t];
+    for (size_t c = 0; c < job.counts.size(); ++c) {
+      size_t &id = table[sets.find(comp_base[t] + c)];
+      if (id == none) {
+        id = objs.size();
+        objs.counts.push_back(job.counts[c]);
+        objs.areas.push_back(job.areas[c]);
+        objs.colors.push_back(job.colors[c]);
+        objs.bounds.push_back(job.bounds[c]);
+        if (objs.track_moments)
+          objs.moments.push_back(job.moments[c]);
+      } else {
+        objs.counts[id] += job.counts[c];
+        objs.areas[id] += job.areas[c];
+        objs.bounds[id] |= job.bounds[c];
+        if (objs.track_moments)
+          add_moments(objs.moments[id], job.moments[c]);
+      }
+      ids[comp_base[t] + c] = id;
+    }
+  }
+
+  bool filtering = ! filter.keeps_all();
+  std::vector<size_t> renumber;
+  if (filtering)
+    filter_objects(filter, objs, renumber);
+
+  objs.wide = wide;
+  objs.offsets.resize(objs.size());
+  size_t offset = 0;
+  for (size_t id = 0; id < objs.size(); ++id) {
+    objs.offsets[id] = offset;
+    offset += objs.counts[id];
+  }
+  if (wide)
+    objs.wide_runs.resize(offset);
+  else
+    objs.short_runs.resize(offset);
+
+  // Each object's runs go tile by tile, so a tile's part of an object
+  // starts after the same object's runs in the tiles above.  Components
+  // of one object in a tile share a part, keeping its runs in order.
+  std::vector<size_t> next(objs.offsets);
+  std::vector<size_t> part_of(objs.size(), none);
+  std::vector<size_t> part_tile(objs.size(), none);
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    tile_job_t &job = jobs[t];
+    job.objs = &objs;
+    job.parts.resize(job.counts.size());
+    job.next.clear();
+    for (size_t c = 0; c < job.counts.size(); ++c) {
+      size_t id = ids[comp_base[t] + c];
+      if (filtering)
+        id = renumber[id];
+      if (id == none) {
+        job.parts[c] = none;
+        continue;
+      }
+      if (part_tile[id] != t) {
+        part_tile[id] = t;
+        part_of[id] = job.next.size();
+        job.next.push_back(next[id]);
+      }
+      job.parts[c] = part_of[id];
+      next[id] += job.counts[c];
+    }
+  }
+}
+
+static void
+keep_tile_runs(const std::vector<tile_job_t> &jobs, int rows, int cols,
+               RunRows &kept)
+{
+  kept.rows = rows;
+  kept.cols = cols;
+  kept.runs.clear();
+  kept.colors.clear();
+  for (size_t t = 0; t < jobs.size(); ++t) {
+    const RunGraph &graph = jobs[t].graph;
+    for (size_t i = 0; i < graph.size(); ++i) {
+      kept.runs.push_back(graph.nodes[i]);
+      kept.colors.push_back(graph.nodes[i].color);
+    }
+  }
+}
+
+// Each of nthreads horizontal tiles of the image is labeled and grouped
+// on its own thread.  Only the runs on either side of a seam are joined
+// afterwards, and the tiles' runs are copied out on their threads again,
+// so the objects are identical to objfind()'s.
+static void
+objfind_tiles(const cv::Mat &img, ObjectSet &objs, int nthreads,
+              const ObjFilter &filter, RunRows *rows)
+{
+  assert(img.depth() == CV_8U);
+
+  int ntiles = std::min(nthreads, img.rows);
+  if (ntiles <= 1) {
+    if (rows)
+      objfind(img, objs, rows);
+    else
+      objfind(img, objs, filter);
+    return;
+  }
+
+  std::vector<tile_job_t> jobs(ntiles);
+  for (int t = 0; t < ntiles; ++t) {
+    tile_job_t &job = jobs[t];
+    job.img = &img;
+    job.first_row = img.rows * t / ntiles;
+    job.rows = img.rows * (t + 1) / ntiles - job.first_row;
+    job.track_moments = objs.track_moments;
+  }
+  {
+    StageTimer timer("objfind.graph");
+    run_tile_jobs(jobs, label_tile);
+  }
+
+  size_t nruns = 0;
+  size_t nedges = 0;
+  for (int t = 0; t < ntiles; ++t) {
+    nruns += jobs[t].graph.size();
+    nedges += jobs[t].graph.edges.size();
+  }
+  profile_count("runs", nruns);
+  if (rows)
+    keep_tile_runs(jobs, img.rows, img.cols, *rows);
+
+  const int maxshort = std::numeric_limits<ushort>::max();
+  bool wide = maxshort < img.cols || maxshort < img.rows;
+  assert(objs.empty());
+  {
+    StageTimer timer("objfind.group");
+    merge_tiles(jobs, wide, filter, objs);
+  }
+  for (int t = 0; t < ntiles; ++t)
+    nedges += jobs[t].seam_edges.size();
+  profile_count("edges", nedges);
+
+  StageTimer timer("objfind.extract");
+  run_tile_jobs(jobs, copy_tile_runs);
+  profile_count("objects", objs.size());
+}
+
+void
+objfind_parallel(const cv::Mat &img, ObjectSet &objs, int nthreads,
+                 const ObjFilter &filter)
+{
+  objfind_tiles(img, objs, nthreads, filter, 0);
+}
+
+void
+objfind_parallel(const cv::Mat &img, ObjectSet &objs, int nthreads,
+                 RunRows *rows)
+{
+  objfind_tiles(img, objs, nthreads, ObjFilter(), rows);
+}
+
+void
+objfind(const cv::Mat &img, std::vector<Obj> &objs)
+{
+  ObjectSet set;
+  objfind(img, set);
+
+  assert(objs.size() == 0);
+  objs.resize(set.size());
+  for (size_t i = 0; i < set.size(); ++i) {
+    ObjView view = set[i];
+    Obj &obj = objs[i];
+    obj.runs.resize(view.runs.size());
+    for (size_t j = 0; j < view.runs.size(); ++j)
+      obj.runs[j] = view.runs[j];
+    obj.area = view.area;
+    obj.color = view.color;
+    obj.bound = view.bound;
+  }
+}
+
+ObjStream::ObjStream(int width, emit_t callback, void *callback_data)
+  : cols(width), row(0), next_id(0), emit(callback), emit_data(callback_data)
+{
+  assert(0 < cols);
+}
+
+size_t
+ObjStream::find_piece(size_t p)
+{
+  while (pieces[p].parent != p)
+    p = pieces[p].parent = pieces[pieces[p].parent].parent;
+  return p;
+}
+
+size_t
+ObjStream::new_piece(int color)
+{
+  size_t p;
+  if (free_pieces.empty()) {
+    p = pieces.size();
+    pieces.push_back(Piece());
+  } else {
+    p = free_pieces.back();
+    free_pieces.pop_back();
+  }
+
+  Piece &piece = pieces[p];
+  piece.parent = p;
+  piece.color = color;
+  piece.last_row = row;
+  return p;
+}
+
+// The smaller piece's runs and edges move into the larger one, so no run
+// is copied more than log(n) times.
+size_t
+ObjStream::merge_pieces(size_t p1, size_t p2)
+{
+  if (pieces[p1].runs.size() < pieces[p2].runs.size())
+    std::swap(p1, p2);
+  Piece &into = pieces[p1];
+  Piece &from = pieces[p2];
+  into.runs.insert(into.runs.end(), from.runs.begin(), from.runs.end());
+  into.edges.insert(into.edges.end(), from.edges.begin(), from.edges.end());
+  std::vector<StreamRun>().swap(from.runs);
+  std::vector<Edge>().swap(from.edges);
+  from.parent = p1;
+  return p1;
+}
+
+// Same overlap sweep as connect_run_to_graph, over the previous row.
+void
+ObjStream::add_run(RunBase &run, int color, size_t *above)
+{
+  size_t id = next_id++;
+  const size_t none = std::numeric_limits<size_t>::max();
+  size_t p = none;
+
+  while (*above < last_row_runs.size() &&
+         last_row_runs[*above].end <= run.start)
+    ++*above;
+
+  for (size_t i = *above; i < last_row_runs.size(); ++i) {
+    const RowRun &other = last_row_runs[i];
+    if (run.end <= other.start)
+      break;
+    if (other.color != color)
+      continue;
+    size_t q = find_piece(other.piece);
+    if (p == none)
+      p = q;
+    else if (p != q)
+      p = merge_pieces(p, q);
+    Edge edge;
+    edge.below = id;
+    edge.above = other.id;
+    pieces[p].edges.push_back(edge);
+  }
+
+  if (p == none)
+    p = new_piece(color);
+
+  Piece &piece = pieces[p];
+  StreamRun sr;
+  sr.row = run.row;
+  sr.start = run.start;
+  sr.end = run.end;
+  sr.id = id;
+  piece.runs.push_back(sr);
+  piece.last_row = run.row;
+
+  RowRun rr;
+  rr.row = run.row;
+  rr.start = run.start;
+  rr.end = run.end;
+  rr.id = id;
+  rr.color = color;
+  rr.piece = p;
+  cur_row_runs.push_back(rr);
+}
+
+// Rebuilds the object's part of the run graph, in raster order, and runs
+// the batch grouping over it.  Walks never leave an object, so this gives
+// the same flags as labeling the whole image at once.
+void
+ObjStream::close_piece(size_t p)
+{
+  Piece &piece = pieces[p];
+  std::sort(piece.runs.begin(), piece.runs.end(), stream_run_comparator);
+
+  std::vector<size_t> ids(piece.runs.size());
+  RunGraph graph;
+  graph.nodes.resize(piece.runs.size());
+  for (size_t i = 0; i < piece.runs.size(); ++i) {
+    const StreamRun &sr = piece.runs[i];
+    RunNode &node = graph.nodes[i];
+    node.row = sr.row;
+    node.start = sr.start;
+    node.end = sr.end;
+    node.color = piece.color;
+    node.flags = 0;
+    ids[i] = sr.id;
+  }
+
+  std::vector<std::pair<size_t, size_t> > edges(piece.edges.size());
+  for (size_t e = 0; e < piece.edges.size(); ++e) {
+    const Edge &edge = piece.edges[e];
+    size_t below = std::lower_bound(ids.begin(), ids.end(), edge.below) -
+      ids.begin();
+    size_t above = std::lower_bound(ids.begin(), ids.end(), edge.above) -
+      ids.begin();
+    edges[e] = std::make_pair(below, above);
+  }
+  std::sort(edges.begin(), edges.end());
+
+  graph.edges.resize(edges.size());
+  size_t e = 0;
+  for (size_t i = 0; i < graph.size(); ++i) {
+    graph.offsets.push_back(e);
+    for ( ; e < edges.size() && edges[e].first == i; ++e)
+      graph.edges[e] = edges[e].second;
+  }
+  graph.offsets.push_back(e);
+
+  define_objects(graph);
+
+  const int maxint = std::numeric_limits<int>::max();
+  Obj obj;
+  obj.color = piece.color;
+  obj.area = 0;
+  obj.bound.x = maxint;
+  obj.bound.y = maxint;
+  obj.bound.width = -maxint;
+  obj.bound.height = -maxint;
+  obj.runs.resize(graph.size());
+  for (size_t i = 0; i < graph.size(); ++i) {
+    const RunNode &node = graph[i];
+    Run &run = obj.runs[i];
     run.row = node.row;
     run.start = node.start;
     run.end = node.end;
     run.flags = node.flags & (RUN_TOP | RUN_BOTTOM);
+    fix_area_and_bound(obj.area, obj.bound, run);
+  }
 
-    table_t::iterator iter = table.find(node.group);
-    if (iter != table.end())
-      obj = &objs[iter->second];
-    else {
-      objs.push_back(Obj());
-      obj = &objs.back();
-      obj->color = node.color;
-      obj->area = 0;
-      obj->bound = init_bound;
-      table[node.group] = objs.size() - 1;
+  std::vector<StreamRun>().swap(piece.runs);
+  std::vector<Edge>().swap(piece.edges);
+  emit(obj, emit_data);
+}
+
+void
+ObjStream::push_row(const uchar *pixels)
+{
+  row_ends.resize(cols);
+  int nends = row_scanner()(pixels, cols, &row_ends[0]);
+  row_ends[nends++] = cols;
+
+  size_t above = 0;
+  RunBase run;
+  run.row = row;
+  run.start = 0;
+  for (int i = 0; i < nends; ++i) {
+    run.end = row_ends[i];
+    add_run(run, pixels[run.start], &above);
+    run.start = run.end;
+  }
+
+  // Whatever the last row touched but this row didn't is finished.  Every
+  // piece that isn't live after this row can be reused.
+  std::vector<size_t> dead;
+  for (size_t i = 0; i < last_row_runs.size(); ++i) {
+    size_t p = last_row_runs[i].piece;
+    size_t q = find_piece(p);
+    if (p != q)
+      dead.push_back(p);
+    if (pieces[q].last_row < row) {
+      close_piece(q);
+      pieces[q].last_row = row;
+      dead.push_back(q);
     }
+  }
+  for (size_t i = 0; i < cur_row_runs.size(); ++i)
+    cur_row_runs[i].piece = find_piece(cur_row_runs[i].piece);
 
-    obj->runs.push_back(run);
-    fix_area_and_bound(*obj, run);
+  std::sort(dead.begin(), dead.end());
+  dead.erase(std::unique(dead.begin(), dead.end()), dead.end());
+  free_pieces.insert(free_pieces.end(), dead.begin(), dead.end());
+
+  last_row_runs.swap(cur_row_runs);
+  cur_row_runs.clear();
+  ++row;
+}
+
+void
+ObjStream::push_band(const cv::Mat &band)
+{
+  assert(band.type() == CV_8UC1);
+  assert(band.cols == cols);
+  for (int y = 0; y < band.rows; ++y)
+    push_row(band.ptr(y));
+}
+
+void
+ObjStream::finish()
+{
+  for (size_t i = 0; i < last_row_runs.size(); ++i) {
+    size_t p = find_piece(last_row_runs[i].piece);
+    if (pieces[p].last_row < row) {
+      close_piece(p);
+      pieces[p].last_row = row;
+    }
   }
+  last_row_runs.clear();
+  pieces.clear();
+  free_pieces.clear();
 }
 
+static void
+collect_obj(const Obj &obj, void *ptr)
+{
+  std::vector<Obj> *objs = static_cast<std::vector<Obj> *>(ptr);
+  objs->push_back(obj);
+}
+
+static bool
+first_run_comparator(const Obj &o1, const Obj &o2)
+{
+  return stream_run_comparator(o1.runs[0], o2.runs[0]);
+}
+
+// Same result as objfind, but labels band_rows rows of the image at a
+// time through ObjStream.
 void
-objfind(const cv::Mat &img, std::vector<Obj> &objs)
+objfind_streaming(const cv::Mat &img, ObjectSet &objs, int band_rows)
 {
   assert(img.depth() == CV_8U);
+  assert(0 < band_rows);
 
-  std::vector<RunNode> graph;
-  objfind_generate_run_graph(img, graph);
+  std::vector<Obj> closed;
+  ObjStream stream(img.cols, collect_obj, &closed);
+  for (int y = 0; y < img.rows; y += band_rows) {
+    int rows = std::min(band_rows, img.rows - y);
+    stream.push_band(cv::Mat(img, cv::Rect(0, y, img.cols, rows)));
+  }
+  stream.finish();
 
-  define_objects(graph);
+  std::sort(closed.begin(), closed.end(), first_run_comparator);
 
-  assert(objs.size() == 0);
-  extract_objects(graph, objs);
+  const int maxshort = std::numeric_limits<ushort>::max();
+  assert(objs.empty());
+  objs.wide = maxshort < img.cols || maxshort < img.rows;
+  for (size_t i = 0; i < closed.size(); ++i)
+    objs.push_back(closed[i]);
 }
 
-void
-fillobj(cv::Mat &img, const Obj &obj, cv::Scalar color)
+// 8-bit images are filled a row span at a time, straight into the rows;
+// anything else is drawn with cv::line.  Runs are clipped to the image.
+template <typename ObjT>
+static void
+fillobj_runs(cv::Mat &img, const ObjT &obj, cv::Scalar color)
 {
+  if (img.depth() != CV_8U || 4 < img.channels()) {
+    for (size_t i = 0; i < obj.runs.size(); ++i) {
+      const Run &run = obj.runs[i];
+      cv::Point p1(run.start, run.row);
+      cv::Point p2(run.end - 1, run.row);
+      cv::line(img, p1, p2, color);
+    }
+    return;
+  }
+
+  int channels = img.channels();
+  uchar pixel[4];
+  for (int c = 0; c < channels; ++c)
+    pixel[c] = cv::saturate_cast<uchar>(color[c]);
+
   for (size_t i = 0; i < obj.runs.size(); ++i) {
     const Run &run = obj.runs[i];
-    cv::Point p1(run.start, run.row);
-    cv::Point p2(run.end - 1, run.row);
-    cv::line(img, p1, p2, color);
+    if (run.row < 0 || img.rows <= run.row)
+      continue;
+    int start = std::max(run.start, 0);
+    int end = std::min(run.end, img.cols);
+    uchar *p = img.ptr(run.row) + start * channels;
+    if (channels == 1) {
+      if (start < end)
+        std::memset(p, pixel[0], end - start);
+      continue;
+    }
+    for (int x = start; x < end; ++x, p += channels)
+      std::memcpy(p, pixel, channels);
   }
 }
 
 void
-fillgaps(const Obj &src, Obj &dst)
+fillobj(cv::Mat &img, const Obj &obj, cv::Scalar color)
+{
+  fillobj_runs(img, obj, color);
+}
+
+void
+fillobj(cv::Mat &img, const ObjView &obj, cv::Scalar color)
+{
+  fillobj_runs(img, obj, color);
+}
+
+template <typename ObjT>
+static void
+fillgaps_runs(const ObjT &src, Obj &dst)
 {
   dst.runs.clear();
   dst.area = 0;
@@ -239,6 +1636,18 @@ fillgaps(const Obj &src, Obj &dst)
   }
 }
 
+void
+fillgaps(const Obj &src, Obj &dst)
+{
+  fillgaps_runs(src, dst);
+}
+
+void
+fillgaps(const ObjView &src, Obj &dst)
+{
+  fillgaps_runs(src, dst);
+}
+
 static bool
 area_comparator(const Obj &o1, const Obj &o2)
 {
@@ -251,4 +1660,45 @@ sortobjs(std::vector<Obj> &objs)
   std::sort(objs.begin(), objs.end(), area_comparator);
 }
 
+struct index_area_comparator {
+  const std::vector<size_t> *areas;
+
+  bool operator ()(size_t i1, size_t i2) const
+  {
+    return (*areas)[i2] < (*areas)[i1];
+  }
+};
+
+template <typename T>
+static void
+permute(std::vector<T> &v, const std::vector<size_t> &order)
+{
+  std::vector<T> sorted(order.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    sorted[i] = v[order[i]];
+  v.swap(sorted);
+}
+
+// Only the per-object arrays move; each object's runs stay where they
+// are in the run buffer.
+void
+sortobjs(ObjectSet &objs)
+{
+  std::vector<size_t> order(objs.size());
+  for (size_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+
+  index_area_comparator comparator;
+  comparator.areas = &objs.areas;
+  std::sort(order.begin(), order.end(), comparator);
+
+  permute(objs.offsets, order);
+  permute(objs.counts, order);
+  permute(objs.areas, order);
+  permute(objs.colors, order);
+  permute(objs.bounds, order);
+  if (objs.moments.size() == order.size())
+    permute(objs.moments, order);
+}
+
 //}  // namespace objfind
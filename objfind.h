@@ -1,6 +1,7 @@
 #ifndef OBJFIND_INCLUDED
 #define OBJFIND_INCLUDED 1
 
+#include <cmath>
 #include <vector>
 
 #define CV_NO_BACKWARD_COMPATIBILITY
@@ -23,13 +24,320 @@ struct Run : public RunBase {
 struct Obj {
   std::vector<Run> runs;
   size_t area;
-  int color;  // Could be a Scalar if we want multiple colors
+  int color;  // Packed by the labeler's pixel format, e.g. Bgr8
   cv::Rect bound;
 };
 
+// Run record packed into 16-bit fields, used by ObjectSet when every
+// coordinate of the image fits.
+struct ShortRun {
+  ushort row;
+  ushort start;
+  ushort end;
+  ushort flags;
+};
+
+struct ObjectSet;
+
+// The runs of one object in an ObjectSet.  Indexing unpacks a Run by
+// value, so this reads like Obj::runs.
+class RunSpan
+{
+public:
+  RunSpan(const ObjectSet &set, size_t first, size_t count)
+    : set_(&set), first_(first), count_(count)
+  { }
+
+  size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  inline Run operator [](size_t i) const;
+  Run back() const { return (*this)[count_ - 1]; }
+
+private:
+  const ObjectSet *set_;
+  size_t first_;
+  size_t count_;
+};
+
+// A lightweight stand-in for Obj that refers into an ObjectSet.
+struct ObjView {
+  RunSpan runs;
+  size_t area;
+  int color;
+  cv::Rect bound;
+
+  ObjView(const ObjectSet &set, size_t i);
+};
+
+// Shape of one object, summed run by run as it is labeled.  The m
+// sums are the raw moments of its pixels, x being the column and y the
+// row, so m00 is the area.
+struct ObjMoments {
+  double m00, m10, m01, m20, m11, m02;
+  size_t runs;
+  // Pairs of the object's runs in neighbouring rows that touch.
+  size_t links;
+  // Pixel edges between the object and anything else.
+  size_t perimeter;
+
+  ObjMoments()
+    : m00(0.), m10(0.), m01(0.), m20(0.), m11(0.), m02(0.), runs(0),
+      links(0), perimeter(0)
+  { }
+
+  double cx() const { return m10 / m00; }
+  double cy() const { return m01 / m00; }
+  // Central second moments, divided by the area.
+  double mu20() const { return m20 / m00 - cx() * cx(); }
+  double mu11() const { return m11 / m00 - cx() * cy(); }
+  double mu02() const { return m02 / m00 - cy() * cy(); }
+  // Angle of the major axis from the x axis, in radians.
+  double orientation() const
+  {
+    return 0.5 * std::atan2(2. * mu11(), mu20() - mu02());
+  }
+  // The object's runs and links form a graph with one cycle per hole.
+  long holes() const
+  {
+    return static_cast<long>(links) - static_cast<long>(runs) + 1;
+  }
+};
+
+// Objects stored without a run vector per object.  All runs live in one
+// buffer, grouped by object, and the per-object data is kept in parallel
+// arrays indexed by object.  Runs are packed into ShortRun unless the
+// image is too large, in which case wide_runs is used instead.
+struct ObjectSet {
+  bool wide;
+  std::vector<ShortRun> short_runs;
+  std::vector<Run> wide_runs;
+
+  std::vector<size_t> offsets;
+  std::vector<size_t> counts;
+  std::vector<size_t> areas;
+  std::vector<int> colors;
+  std::vector<cv::Rect> bounds;
+
+  // Set before labeling to have moments filled in, one per object.
+  // clear() keeps it.  Sets from the cache have no moments.
+  bool track_moments;
+  std::vector<ObjMoments> moments;
+
+  ObjectSet() : wide(false), track_moments(false) { }
+
+  size_t size() const { return areas.size(); }
+  bool empty() const { return areas.empty(); }
+  ObjView operator [](size_t i) const { return ObjView(*this, i); }
+
+  Run run(size_t i) const
+  {
+    if (wide)
+      return wide_runs[i];
+    const ShortRun &sr = short_runs[i];
+    Run run;
+    run.row = sr.row;
+    run.start = sr.start;
+    run.end = sr.end;
+    run.flags = sr.flags;
+    return run;
+  }
+
+  void push_back(const Obj &obj);
+  void clear();
+};
+
+// Which objects objfind keeps.  Rejected objects are dropped as soon as
+// their area, bound and color are known, before any of their runs are
+// copied out, so they cost nothing in the run buffer or in sortobjs.
+// The defaults keep everything.
+struct ObjFilter {
+  size_t min_area;
+  size_t max_area;
+  int min_width;
+  int max_width;
+  int min_height;
+  int max_height;
+  // Bounds on height / width, the ratio AspectRatioFeature reports, so
+  // limits can be taken from its statistics.
+  double min_aspect;
+  double max_aspect;
+  std::vector<int> ignore_colors;
+  // If not 0, only the top_k largest of the objects that pass are kept,
+  // chosen by partial selection; ties go to the earlier object.
+  size_t top_k;
+
+  ObjFilter();
+
+  bool keeps_all() const;
+  bool accepts(size_t area, const cv::Rect &bound, int color) const;
+};
+
+inline Run
+RunSpan::operator [](size_t i) const
+{
+  return set_->run(first_ + i);
+}
+
+inline
+ObjView::ObjView(const ObjectSet &set, size_t i)
+  : runs(set, set.offsets[i], set.counts[i]),
+    area(set.areas[i]),
+    color(set.colors[i]),
+    bound(set.bounds[i])
+{ }
+
+// Labels an image that is pushed in one row, or one band of rows, at a
+// time.  An object is handed to the callback as soon as the newest row
+// has no run that could still join it, so only the runs of open objects
+// are kept.  Those are kept whole, since the callback gets every run: an
+// object that stays open for most of the image, such as the page
+// background, holds a run per row until the end, and memory is then
+// O(image) as in batch labeling.  It stays small when every object is
+// short next to the image.  Objects come out in the order they close
+// rather than the batch order; objfind_streaming restores that order.
+class ObjStream
+{
+public:
+  typedef void (*emit_t)(const Obj &, void *);
+
+  ObjStream(int width, emit_t callback, void *callback_data);
+
+  void push_row(const uchar *row);
+  void push_band(const cv::Mat &band);
+  void finish();
+
+private:
+  // Runs and edges are named by a sequence number in raster order.
+  struct StreamRun : public RunBase {
+    size_t id;
+  };
+
+  struct Edge {
+    size_t below;
+    size_t above;
+  };
+
+  // An open object, or one that has been merged into another.
+  struct Piece {
+    size_t parent;
+    int color;
+    int last_row;
+    std::vector<StreamRun> runs;
+    std::vector<Edge> edges;
+  };
+
+  struct RowRun : public RunBase {
+    size_t id;
+    int color;
+    size_t piece;
+  };
+
+  int cols;
+  int row;
+  size_t next_id;
+  emit_t emit;
+  void *emit_data;
+  std::vector<Piece> pieces;
+  std::vector<size_t> free_pieces;
+  std::vector<RowRun> last_row_runs;
+  std::vector<RowRun> cur_row_runs;
+  std::vector<int> row_ends;
+
+  size_t find_piece(size_t p);
+  size_t new_piece(int color);
+  size_t merge_pieces(size_t p1, size_t p2);
+  void add_run(RunBase &run, int color, size_t *above);
+  void close_piece(size_t p);
+};
+
+// The runs of a labeled image in raster order, with their colors.  An
+// image whose pixels are a function of these colors, such as a coarser
+// quantization, has runs that are these runs joined end to end, so it
+// can be labeled from them without its pixels.
+struct RunRows {
+  int rows;
+  int cols;
+  std::vector<RunBase> runs;
+  std::vector<uchar> colors;
+};
+
+// Stores the x of each pixel in a row that differs from the one to its
+// left and returns how many it stored.  ends needs room for cols - 1.
+typedef int (*row_scanner_t)(const uchar *row, int cols, int *ends);
+
+// "avx2", "sse2" or "scalar", or 0 for the best this CPU supports.
+// Returns 0 if the named scanner isn't available.
+row_scanner_t find_row_scanner(const char *isa);
+
+// Pixel formats objfind can label.  color() packs the pixel at x into
+// the int kept as each object's color.
+struct Gray8 {
+  static const int channels = 1;
+  static int color(const uchar *row, int x) { return row[x]; }
+};
+
+// Packed as 0xRRGGBB.
+struct Bgr8 {
+  static const int channels = 3;
+  static int color(const uchar *row, int x)
+  {
+    const uchar *p = row + 3 * x;
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+  }
+};
+
+// Color predicates.  A run holds the pixels of a row that match its
+// first pixel, and touching runs are joined if their colors match.
+struct SameColor {
+  bool operator ()(int a, int b) const { return a == b; }
+};
+
+// Every 8-bit channel within tolerance.  Unlike SameColor this isn't
+// transitive, so a gradient can chain into one object.
+struct NearColor {
+  explicit NearColor(int tolerance) : tolerance(tolerance) { }
+
+  bool operator ()(int a, int b) const
+  {
+    for (int shift = 0; shift < 24; shift += 8) {
+      int d = ((a >> shift) & 0xff) - ((b >> shift) & 0xff);
+      if (d < -tolerance || tolerance < d)
+        return false;
+    }
+    return true;
+  }
+
+  int tolerance;
+};
+
+// Labels img, with Connectivity 4 or 8, reading pixels as Pixel and
+// comparing colors with same.  Instantiated for Gray8 and Bgr8 with
+// SameColor and NearColor; each is compiled on its own, so
+// objfind_with<4, Gray8>(img, objs, SameColor()) is objfind(img, objs).
+template<int Connectivity, typename Pixel, typename Same>
+void objfind_with(const cv::Mat &img, ObjectSet &objs, const Same &same);
+
+void objfind(const cv::Mat &img, ObjectSet &objs);
+void objfind(const cv::Mat &img, ObjectSet &objs, const ObjFilter &filter);
+// Also keeps the image's runs in *rows.
+void objfind(const cv::Mat &img, ObjectSet &objs, RunRows *rows);
+// Labels the image that has map[c] wherever the image of fine has c, and
+// keeps its runs in *rows if rows isn't 0.
+void objfind_remapped(const RunRows &fine, const uchar *map, ObjectSet &objs,
+                      RunRows *rows);
+// Labels nthreads horizontal tiles of img at once; the objects are the
+// same as objfind's.
+void objfind_parallel(const cv::Mat &img, ObjectSet &objs, int nthreads,
+                      const ObjFilter &filter = ObjFilter());
+void objfind_parallel(const cv::Mat &img, ObjectSet &objs, int nthreads,
+                      RunRows *rows);
+void objfind_streaming(const cv::Mat &img, ObjectSet &objs, int band_rows);
 void objfind(const cv::Mat &img, std::vector<Obj> &objs);
 void fillobj(cv::Mat &img, const Obj &obj, cv::Scalar color);
+void fillobj(cv::Mat &img, const ObjView &obj, cv::Scalar color);
 void fillgaps(const Obj &src, Obj &dst);
+void fillgaps(const ObjView &src, Obj &dst);
 void sortobjs(std::vector<Obj> &objs);
+void sortobjs(ObjectSet &objs);
 
 #endif  // OBJFIND_INCLUDED
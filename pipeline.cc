@@ -0,0 +1,198 @@
+#include <cstdlib>
+#include <iostream>
+
+#include "pipeline.h"
+
+BoundedQueue::BoundedQueue(size_t depth)
+  : depth(depth < 1 ? 1 : depth), closed(false)
+{
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&not_empty, 0);
+  pthread_cond_init(&not_full, 0);
+}
+
+BoundedQueue::~BoundedQueue()
+{
+  pthread_cond_destroy(&not_full);
+  pthread_cond_destroy(&not_empty);
+  pthread_mutex_destroy(&lock);
+}
+
+void
+BoundedQueue::push(void *item)
+{
+  pthread_mutex_lock(&lock);
+  while (depth <= items.size())
+    pthread_cond_wait(&not_full, &lock);
+  items.push_back(item);
+  pthread_cond_signal(&not_empty);
+  pthread_mutex_unlock(&lock);
+}
+
+bool
+BoundedQueue::pop(void *&item)
+{
+  pthread_mutex_lock(&lock);
+  while (items.empty() && ! closed)
+    pthread_cond_wait(&not_empty, &lock);
+  bool popped = ! items.empty();
+  if (popped) {
+    item = items.front();
+    items.pop_front();
+    pthread_cond_signal(&not_full);
+  }
+  pthread_mutex_unlock(&lock);
+  return popped;
+}
+
+void
+BoundedQueue::close()
+{
+  pthread_mutex_lock(&lock);
+  closed = true;
+  pthread_cond_broadcast(&not_empty);
+  pthread_mutex_unlock(&lock);
+}
+
+Pipeline::Pipeline(size_t output_depth)
+  : output_depth(output_depth), fed(0), started(false), stopping(false)
+{
+  pthread_mutex_init(&feed_lock, 0);
+}
+
+Pipeline::~Pipeline()
+{
+  finish();
+  pthread_mutex_destroy(&feed_lock);
+  for (size_t i = 0; i < stages.size(); ++i) {
+    pthread_mutex_destroy(&stages[i]->lock);
+    delete stages[i];
+  }
+  for (size_t i = 0; i < queues.size(); ++i)
+    delete queues[i];
+}
+
+void
+Pipeline::add_stage(stage_t run, void *stage_data, int nthreads,
+                    size_t depth)
+{
+  Stage *stage = new Stage;
+  stage->run = run;
+  stage->data = stage_data;
+  stage->nthreads = nthreads < 1 ? 1 : nthreads;
+  stage->running = stage->nthreads;
+  stage->in = new BoundedQueue(depth);
+  stage->out = 0;
+  pthread_mutex_init(&stage->lock, 0);
+  queues.push_back(stage->in);
+  stages.push_back(stage);
+}
+
+void *
+Pipeline::feed(void *ptr)
+{
+  Pipeline *pipeline = static_cast<Pipeline *>(ptr);
+  BoundedQueue *first = pipeline->queues[0];
+  size_t i;
+  for (i = 0; i < pipeline->inputs.size(); ++i) {
+    pthread_mutex_lock(&pipeline->feed_lock);
+    bool stopping = pipeline->stopping;
+    pthread_mutex_unlock(&pipeline->feed_lock);
+    if (stopping)
+      break;
+    first->push(pipeline->inputs[i]);
+  }
+  pipeline->fed = i;
+  first->close();
+  return 0;
+}
+
+// The last worker out of a stage closes the queue after it.
+void *
+Pipeline::work(void *ptr)
+{
+  Worker *worker = static_cast<Worker *>(ptr);
+  Stage *stage = worker->stage;
+
+  void *item;
+  while (stage->in->pop(item)) {
+    void *result = stage->run(item, stage->data, worker->index);
+    if (result)
+      stage->out->push(result);
+  }
+
+  pthread_mutex_lock(&stage->lock);
+  bool last = --stage->running == 0;
+  pthread_mutex_unlock(&stage->lock);
+  if (last)
+    stage->out->close();
+  return 0;
+}
+
+void
+Pipeline::start(const std::vector<void *> &items)
+{
+  inputs = items;
+  fed = 0;
+  queues.push_back(new BoundedQueue(output_depth));
+  for (size_t i = 0; i < stages.size(); ++i) {
+    stages[i]->out = queues[i + 1];
+    for (int w = 0; w < stages[i]->nthreads; ++w) {
+      Worker worker;
+      worker.stage = stages[i];
+      worker.index = w;
+      workers.push_back(worker);
+    }
+  }
+
+  // A stage left with no threads would stall everything behind it.
+  threads.resize(workers.size());
+  for (size_t w = 0; w < workers.size(); ++w) {
+    if (pthread_create(&threads[w], 0, work, &workers[w]) != 0) {
+      std::cerr << "Can't start pipeline thread" << std::endl;
+      std::exit(1);
+    }
+  }
+  if (pthread_create(&feeder, 0, feed, this) != 0) {
+    std::cerr << "Can't start pipeline thread" << std::endl;
+    std::exit(1);
+  }
+  started = true;
+}
+
+bool
+Pipeline::next(void *&item)
+{
+  return queues.back()->pop(item);
+}
+
+void
+Pipeline::stop()
+{
+  pthread_mutex_lock(&feed_lock);
+  stopping = true;
+  pthread_mutex_unlock(&feed_lock);
+}
+
+// Whatever was fed comes out of the last queue, so draining it and then
+// the inputs the feeder never reached accounts for every item.
+void
+Pipeline::finish(dispose_t dispose, void *dispose_data)
+{
+  if (! started)
+    return;
+  void *item;
+  while (next(item)) {
+    if (dispose)
+      dispose(item, dispose_data);
+  }
+  pthread_join(feeder, 0);
+  for (size_t w = 0; w < threads.size(); ++w)
+    pthread_join(threads[w], 0);
+  if (dispose) {
+    for (size_t i = fed; i < inputs.size(); ++i)
+      dispose(inputs[i], dispose_data);
+  }
+  inputs.clear();
+  started = false;
+}
@@ -0,0 +1,109 @@
+#ifndef PIPELINE_INCLUDED
+#define PIPELINE_INCLUDED 1
+
+#include <deque>
+#include <vector>
+
+#include <pthread.h>
+
+// A FIFO of items shared between threads.  push() blocks while depth
+// items are waiting, which is what keeps a fast stage from running ahead
+// of a slow one.  After close(), pop() returns false once it's empty.
+class BoundedQueue
+{
+public:
+  explicit BoundedQueue(size_t depth);
+  ~BoundedQueue();
+
+  void push(void *item);
+  bool pop(void *&item);
+  void close();
+
+private:
+  size_t depth;
+  bool closed;
+  std::deque<void *> items;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+
+  BoundedQueue(const BoundedQueue &);
+  BoundedQueue &operator =(const BoundedQueue &);
+};
+
+// Items passed through a chain of stages, each run by its own threads and
+// fed by its own bounded queue, so that stages overlap: while one item is
+// being decoded the next is read and the one before is labeled.  Items
+// keep their order only through stages with one thread.
+//
+// The pipeline never frees an item.  Each item given to start() is the
+// caller's again once it comes out of next() or is handed to finish()'s
+// dispose, which happens exactly once, unless a stage drops it by
+// returning 0, in which case that stage must have freed it.
+class Pipeline
+{
+public:
+  // Runs one item through a stage and returns what to hand to the next
+  // stage, or 0 to drop it.  worker counts from 0 to the stage's
+  // nthreads, for looking up per-thread state in stage_data.
+  typedef void *(*stage_t)(void *item, void *stage_data, int worker);
+  // Takes back an item the caller never got from next().
+  typedef void (*dispose_t)(void *item, void *dispose_data);
+
+  // The last stage's results wait for next() in a queue output_depth
+  // deep.
+  explicit Pipeline(size_t output_depth = 1);
+  ~Pipeline();
+
+  // Stages run in the order they're added.  depth is how many items may
+  // wait for the stage.
+  void add_stage(stage_t run, void *stage_data, int nthreads, size_t depth);
+
+  // Starts every stage and feeds items to the first.
+  void start(const std::vector<void *> &items);
+  // The next result of the last stage, or false when there are no more.
+  bool next(void *&item);
+  // Feeds no more items.  Those already fed still come out of next().
+  void stop();
+  // Waits for all the threads.  Results not taken by next(), and items
+  // never fed because of stop(), go to dispose, or are dropped without
+  // one.
+  void finish(dispose_t dispose = 0, void *dispose_data = 0);
+
+private:
+  struct Stage {
+    stage_t run;
+    void *data;
+    int nthreads;
+    int running;
+    BoundedQueue *in;
+    BoundedQueue *out;
+    pthread_mutex_t lock;
+  };
+
+  struct Worker {
+    Stage *stage;
+    int index;
+  };
+
+  size_t output_depth;
+  std::vector<Stage *> stages;
+  std::vector<BoundedQueue *> queues;
+  std::vector<Worker> workers;
+  std::vector<pthread_t> threads;
+  std::vector<void *> inputs;
+  // How many of inputs the feeder pushed, once it's done.
+  size_t fed;
+  pthread_t feeder;
+  bool started;
+  bool stopping;
+  pthread_mutex_t feed_lock;
+
+  static void *feed(void *ptr);
+  static void *work(void *ptr);
+
+  Pipeline(const Pipeline &);
+  Pipeline &operator =(const Pipeline &);
+};
+
+#endif  // PIPELINE_INCLUDED
@@ -1,40 +1,196 @@
+#include <algorithm>
+#include <cassert>
+#include <climits>
+
 #include "features.h"
 
 static double
-score_position(objs_t &objs, size_t subject, bool top)
+score_pair(const cv::Rect &obj, const cv::Rect &other, bool top)
 {
-  const Obj &obj = objs[subject];
-  double tally = 0.;
+  double wd = obj.width - other.width;
+  double hd = obj.height - other.height;
+  double scale = obj.width * obj.height;
+  double size_diff = std::fabs(wd * hd / scale);
+  double pos_diff;
+  if (top)
+    pos_diff = std::fabs(obj.y - other.y);
+  else
+    pos_diff = std::fabs(obj.y + obj.height -
+                         other.y - other.height);
+  pos_diff /= obj.height;
+
+  return std::exp(-size_diff * pos_diff);
+}
+
+PositionFeature::PositionFeature(bool top, double epsilon)
+  : top(top), epsilon(epsilon), worst_error(0.), pairs_scored(0),
+    indexed(0)
+{
+  assert(0. <= epsilon && epsilon < 1.);
+}
+
+int
+PositionFeature::position(const cv::Rect &bound) const
+{
+  return top ? bound.y : bound.y + bound.height;
+}
+
+void
+PositionFeature::begin_image(objs_t &objs)
+{
+  if (epsilon == 0.)
+    return;
+
+  by_height.clear();
+  width_counts.clear();
+  height_counts.clear();
+  size_counts.clear();
+  levels.clear();
 
   for (size_t i = 0; i < objs.size(); ++i) {
-    if (i == subject) continue;
+    const cv::Rect &bound = objs.bounds[i];
+    Entry entry;
+    entry.pos = position(bound);
+    entry.id = i;
+    by_height[bound.height].push_back(entry);
+    ++width_counts[bound.width];
+    ++height_counts[bound.height];
+    ++size_counts[std::make_pair(bound.width, bound.height)];
+    Level level;
+    level.pos = entry.pos;
+    level.width = bound.width;
+    level.height = bound.height;
+    levels.push_back(level);
+  }
+
+  height_index_t::iterator iter;
+  for (iter = by_height.begin(); iter != by_height.end(); ++iter)
+    std::sort(iter->second.begin(), iter->second.end(), entry_less);
+  level_sizes = levels;
+  std::sort(levels.begin(), levels.end(), level_less);
+  std::sort(level_sizes.begin(), level_sizes.end(), level_size_less);
+
+  indexed = &objs;
+}
+
+double
+PositionFeature::describe(objs_t &objs, size_t subject)
+{
+  if (epsilon == 0.)
+    return describe_exact(objs, subject);
+  return describe_pruned(objs, subject);
+}
 
-    double wd = obj.bound.width - objs[i].bound.width;
-    double hd = obj.bound.height - objs[i].bound.height;
-    double scale = obj.bound.width * obj.bound.height;
-    double size_diff = std::fabs(wd * hd / scale);
-    double pos_diff;
-    if (top)
-      pos_diff = std::fabs(obj.bound.y - objs[i].bound.y);
+void
+PositionFeature::describe_all(objs_t &objs, double *column)
+{
+  pairs_scored = 0;
+  for (size_t i = 0; i < objs.size(); ++i) {
+    if (epsilon == 0.)
+      column[i] = describe_exact(objs, i);
     else
-      pos_diff = std::fabs(obj.bound.y + obj.bound.height -
-                           objs[i].bound.y - objs[i].bound.height);
-    pos_diff /= obj.bound.height;
+      column[i] = describe_pruned(objs, i);
+  }
+  profile_count("pairs", pairs_scored);
+}
 
-    tally += std::exp(-size_diff * pos_diff);
+double
+PositionFeature::describe_exact(objs_t &objs, size_t subject)
+{
+  const cv::Rect &obj = objs.bounds[subject];
+  double tally = 0.;
+
+  for (size_t i = 0; i < objs.size(); ++i) {
+    if (i == subject) continue;
+    tally += score_pair(obj, objs.bounds[i], top);
   }
+  pairs_scored += objs.size() - 1;
 
   return tally / objs.size();
 }
 
-double
-TopPositionFeature::describe(objs_t &objs, size_t subject)
+// The items from first to last inclusive, in items sorted by less.
+template<typename T, typename Less>
+static size_t
+count_between(const std::vector<T> &items, const T &first, const T &last,
+              Less less)
 {
-  return score_position(objs, subject, true);
+  return std::upper_bound(items.begin(), items.end(), last, less) -
+    std::lower_bound(items.begin(), items.end(), first, less);
 }
 
+// Objects at pos whose width isn't width and whose height is outside
+// [low, high].
+size_t
+PositionFeature::count_far_level(int pos, int width, int low, int high) const
+{
+  Level first = { pos, width, INT_MIN };
+  Level last = { pos, width, INT_MAX };
+  Level near_first = { pos, width, low };
+  Level near_last = { pos, width, high };
+  return count_between(levels, first, last, level_less) -
+    count_between(levels, near_first, near_last, level_less) -
+    count_between(level_sizes, first, last, level_size_less) +
+    count_between(level_sizes, near_first, near_last, level_size_less);
+}
+
+// A pair scores exp(-|wd| |hd| |pos diff| / (w h h)).  Objects with the
+// same width or height as the subject score exactly 1 and are counted
+// without being visited.  For the rest |wd| >= 1, so in a bucket of
+// objects of one height, those further than w h h ln(1/epsilon) / |hd|
+// away score below epsilon and are skipped.  Once |hd| is past
+// w h h ln(1/epsilon) that distance is under a pixel, so only the buckets
+// of nearer heights are visited, and objects in the others at the
+// subject's own position, which score exactly 1, are counted.
 double
-BottomPositionFeature::describe(objs_t &objs, size_t subject)
+PositionFeature::describe_pruned(objs_t &objs, size_t subject)
 {
-  return score_position(objs, subject, false);
+  assert(indexed == &objs);
+  const cv::Rect &obj = objs.bounds[subject];
+  int pos = position(obj);
+
+  size_t same = width_counts[obj.width] + height_counts[obj.height] -
+    size_counts[std::make_pair(obj.width, obj.height)];
+  // The subject itself was counted once.
+  double tally = same - 1;
+  size_t visited = 0;
+
+  double threshold = -std::log(epsilon);
+  double reach = threshold * obj.width * obj.height * obj.height;
+  int span = static_cast<int>(std::min(reach, 1e9));
+  int low = obj.height - span;
+  int high = obj.height + span;
+
+  height_index_t::const_iterator iter = by_height.lower_bound(low);
+  height_index_t::const_iterator end = by_height.upper_bound(high);
+  size_t far = 0;
+  if (iter != by_height.begin() || end != by_height.end())
+    far = count_far_level(pos, obj.width, low, high);
+  tally += far;
+  for ( ; iter != end; ++iter) {
+    if (iter->first == obj.height)
+      continue;
+    double radius = reach / std::abs(obj.height - iter->first);
+    const std::vector<Entry> &entries = iter->second;
+
+    Entry key;
+    key.pos = static_cast<int>(std::ceil(std::max(pos - radius, -1e9)));
+    std::vector<Entry>::const_iterator e =
+      std::lower_bound(entries.begin(), entries.end(), key,
+                       entry_less);
+    for ( ; e != entries.end() && e->pos - pos <= radius; ++e) {
+      const cv::Rect &other = objs.bounds[e->id];
+      if (other.width == obj.width)
+        continue;
+      tally += score_pair(obj, other, top);
+      ++visited;
+    }
+  }
+
+  pairs_scored += visited;
+  size_t skipped = objs.size() - same - visited - far;
+  double error = skipped * epsilon / objs.size();
+  worst_error = std::max(worst_error, error);
+
+  return tally / objs.size();
 }
@@ -1,9 +1,12 @@
 #include <cstdlib>
-#include <set>
+#include <sstream>
 
 #include "sql.h"
 
-typedef std::set<sqlite3 *> db_set_t;
+// Open connections and their statement caches.
+typedef std::map<sqlite3 *, SqlStatementCache *> db_set_t;
+
+static pthread_mutex_t close_set_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void close_dbs();
 
@@ -18,13 +21,18 @@ get_close_set()
   return close_set;
 }
 
+// Cached statements are finalized first, so the close really closes.
 static void
 close_dbs()
 {
   db_set_t *close_set = get_close_set();
   db_set_t::iterator iter;
-  for (iter = close_set->begin(); iter != close_set->end(); ++iter)
-    sqlite3_close(*iter);
+  for (iter = close_set->begin(); iter != close_set->end(); ++iter) {
+    delete iter->second;
+    if (! sqlite3_get_autocommit(iter->first))
+      sqlite3_exec(iter->first, "COMMIT", 0, 0, 0);
+    sqlite3_close_v2(iter->first);
+  }
 }
 
 int
@@ -35,7 +43,192 @@ open_sql_db_and_ensure_close_on_exit(const char *filename,
   if (! *db)
     std::abort();
 
+  pthread_mutex_lock(&close_set_lock);
   db_set_t *close_set = get_close_set();
-  close_set->insert(*db);
+  close_set->insert(std::make_pair(*db, new SqlStatementCache(*db)));
+  pthread_mutex_unlock(&close_set_lock);
   return status;
 }
+
+void
+set_sql_durability(sqlite3 *db, const char *journal_mode,
+                   const char *synchronous)
+{
+  std::string mode_stmt = std::string("PRAGMA journal_mode=") + journal_mode;
+  SqlStatement mode(db, mode_stmt);
+  while (mode.step())
+    ;
+
+  std::string sync_stmt = std::string("PRAGMA synchronous=") + synchronous;
+  SQL_OK(sqlite3_exec(db, sync_stmt.c_str(), 0, 0, 0));
+}
+
+SqlStatement::SqlStatement(sqlite3 *db, const std::string &sql)
+{
+  SQL_OK(sqlite3_prepare_v2(db, sql.data(), sql.size(), &stmt, 0));
+}
+
+SqlStatement::~SqlStatement()
+{
+  sqlite3_finalize(stmt);
+}
+
+SqlStatement &
+SqlStatement::bind(int param, int value)
+{
+  SQL_OK(sqlite3_bind_int(stmt, param, value));
+  return *this;
+}
+
+SqlStatement &
+SqlStatement::bind(int param, double value)
+{
+  SQL_OK(sqlite3_bind_double(stmt, param, value));
+  return *this;
+}
+
+SqlStatement &
+SqlStatement::bind(int param, const std::string &value)
+{
+  SQL_OK(sqlite3_bind_text(stmt, param, value.data(), value.size(),
+                           SQLITE_TRANSIENT));
+  return *this;
+}
+
+bool
+SqlStatement::step()
+{
+  int res = sqlite3_step(stmt);
+  if (res == SQLITE_ROW)
+    return true;
+  SQL_CHECK(res, SQLITE_DONE);
+  reset();
+  return false;
+}
+
+void
+SqlStatement::run()
+{
+  while (step())
+    ;
+}
+
+void
+SqlStatement::reset()
+{
+  sqlite3_reset(stmt);
+  SQL_OK(sqlite3_clear_bindings(stmt));
+}
+
+int
+SqlStatement::column_int(int column)
+{
+  return sqlite3_column_int(stmt, column);
+}
+
+double
+SqlStatement::column_double(int column)
+{
+  return sqlite3_column_double(stmt, column);
+}
+
+std::string
+SqlStatement::column_text(int column)
+{
+  const unsigned char *text = sqlite3_column_text(stmt, column);
+  int bytes = sqlite3_column_bytes(stmt, column);
+  return text ? std::string(reinterpret_cast<const char *>(text), bytes) : "";
+}
+
+SqlStatementCache::~SqlStatementCache()
+{
+  cache_t::iterator iter;
+  for (iter = cache.begin(); iter != cache.end(); ++iter)
+    delete iter->second;
+}
+
+SqlStatementCache &
+SqlStatementCache::of(sqlite3 *db)
+{
+  pthread_mutex_lock(&close_set_lock);
+  db_set_t *close_set = get_close_set();
+  db_set_t::iterator iter = close_set->find(db);
+  bool found = iter != close_set->end();
+  pthread_mutex_unlock(&close_set_lock);
+  if (! found)
+    std::abort();
+  return *iter->second;
+}
+
+SqlStatement &
+SqlStatementCache::get(const std::string &sql)
+{
+  cache_t::iterator iter = cache.find(sql);
+  if (iter == cache.end()) {
+    SqlStatement *stmt = new SqlStatement(db, sql);
+    iter = cache.insert(std::make_pair(sql, stmt)).first;
+  }
+  return *iter->second;
+}
+
+SqlBatch::SqlBatch(sqlite3 *db, size_t batch_size)
+  : db(db), batch_size(batch_size), pending(0), open(false)
+{ }
+
+SqlBatch::~SqlBatch()
+{
+  commit();
+}
+
+void
+SqlBatch::begin()
+{
+  SQL_OK(sqlite3_exec(db, "BEGIN", 0, 0, 0));
+  open = true;
+}
+
+void
+SqlBatch::run(SqlStatement &stmt)
+{
+  if (! open)
+    begin();
+  stmt.run();
+  if (batch_size <= ++pending)
+    commit();
+}
+
+void
+SqlBatch::commit()
+{
+  if (open)
+    SQL_OK(sqlite3_exec(db, "COMMIT", 0, 0, 0));
+  open = false;
+  pending = 0;
+}
+
+std::string
+SqlBulkInsert::insert_sql(const std::string &table,
+                          const std::vector<std::string> &columns)
+{
+  std::stringstream buffer;
+  buffer << "INSERT INTO '" << table << "' (";
+  for (size_t i = 0; i < columns.size(); ++i)
+    buffer << (i ? ", " : "") << columns[i];
+  buffer << ") VALUES (";
+  for (size_t i = 0; i < columns.size(); ++i)
+    buffer << (i ? ", ?" : "?");
+  buffer << ");";
+  return buffer.str();
+}
+
+SqlBulkInsert::SqlBulkInsert(sqlite3 *db, const std::string &table,
+                             const std::vector<std::string> &columns,
+                             size_t batch_size)
+  : batch(db, batch_size), stmt(db, insert_sql(table, columns))
+{ }
+
+void
+SqlBulkInsert::insert()
+{
+  batch.run(stmt);
+}
@@ -1,9 +1,13 @@
 #ifndef SQL_INCLUDED
 #define SQL_INCLUDED 1
 
+#include <cstdlib>
 #include <iostream>
+#include <map>
 #include <string>
+#include <vector>
 
+#include <pthread.h>
 #include <sqlite3.h>
 
 #define SQL_CHECK(code, expected)                               \
@@ -19,8 +23,115 @@
 
 #define SQL_OK(code) SQL_CHECK(code, SQLITE_OK)
 
+// Any transaction still open when the program exits is committed before
+// the database is closed.  The connection gets a SqlStatementCache, see
+// SqlStatementCache::of.
 extern int
 open_sql_db_and_ensure_close_on_exit(const char *filename,
                                      sqlite3 **db);
 
+// journal_mode and synchronous are the values for the pragmas of the same
+// name, e.g. "WAL" and "NORMAL".
+extern void
+set_sql_durability(sqlite3 *db, const char *journal_mode,
+                   const char *synchronous);
+
+// A prepared statement.  Parameters and columns count from 1 and 0, as
+// in the sqlite3 API.  step() returns true for each row, then false once,
+// after which the statement is reset and ready to be bound again.
+class SqlStatement
+{
+public:
+  SqlStatement(sqlite3 *db, const std::string &sql);
+  ~SqlStatement();
+
+  SqlStatement &bind(int param, int value);
+  SqlStatement &bind(int param, double value);
+  SqlStatement &bind(int param, const std::string &value);
+
+  bool step();
+  // Steps through a statement that returns no rows.
+  void run();
+  void reset();
+
+  int column_int(int column);
+  double column_double(int column);
+  std::string column_text(int column);
+
+private:
+  sqlite3_stmt *stmt;
+
+  SqlStatement(const SqlStatement &);
+  SqlStatement &operator =(const SqlStatement &);
+};
+
+// Statements prepared once per connection and reused by their SQL text.
+// A statement is only free again once step() has returned false or it
+// has been reset, so a caller mustn't leave one half stepped.
+class SqlStatementCache
+{
+public:
+  explicit SqlStatementCache(sqlite3 *db) : db(db) {}
+  ~SqlStatementCache();
+
+  // The cache of a connection opened by
+  // open_sql_db_and_ensure_close_on_exit.  Like the connection, it's for
+  // one thread at a time.
+  static SqlStatementCache &of(sqlite3 *db);
+
+  SqlStatement &get(const std::string &sql);
+
+private:
+  typedef std::map<std::string, SqlStatement *> cache_t;
+
+  sqlite3 *db;
+  cache_t cache;
+
+  SqlStatementCache(const SqlStatementCache &);
+  SqlStatementCache &operator =(const SqlStatementCache &);
+};
+
+// Groups writes into transactions of up to batch_size writes instead of
+// one per statement.  Whatever is left is committed by commit() or the
+// destructor.
+class SqlBatch
+{
+public:
+  SqlBatch(sqlite3 *db, size_t batch_size);
+  ~SqlBatch();
+
+  // Runs stmt as one write of the current transaction.
+  void run(SqlStatement &stmt);
+  void commit();
+
+private:
+  sqlite3 *db;
+  size_t batch_size;
+  size_t pending;
+  bool open;
+
+  void begin();
+};
+
+// Inserts rows into one table with a single prepared statement inside
+// batched transactions.  Bind columns 1 to n on row(), then call insert().
+class SqlBulkInsert
+{
+public:
+  SqlBulkInsert(sqlite3 *db, const std::string &table,
+                const std::vector<std::string> &columns,
+                size_t batch_size = 10000);
+
+  SqlStatement &row() { return stmt; }
+  void insert();
+  void finish() { batch.commit(); }
+
+private:
+  SqlBatch batch;
+  SqlStatement stmt;
+
+  static std::string insert_sql(const std::string &table,
+                                const std::vector<std::string> &columns);
+};
+
 #endif  // SQL_INCLUDED
@@ -0,0 +1,192 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <utility>
+
+#include "stats.h"
+
+void
+RunningStats::add(double x)
+{
+  ++n;
+  double delta = x - ave;
+  ave += delta / n;
+  m2 += delta * (x - ave);
+}
+
+// Chan et al.'s pairwise update.
+void
+RunningStats::merge(const RunningStats &other)
+{
+  if (other.n == 0)
+    return;
+  if (n == 0) {
+    *this = other;
+    return;
+  }
+
+  double total = n + other.n;
+  double delta = other.ave - ave;
+  ave += delta * other.n / total;
+  m2 += other.m2 + delta * delta * n * other.n / total;
+  n += other.n;
+}
+
+Histogram::Histogram(double lo, double hi, int nbins)
+  : lo(lo), width((hi - lo) / nbins), n(0), counts(nbins, 0)
+{
+  assert(0 < nbins && lo < hi);
+}
+
+void
+Histogram::add(double x)
+{
+  double bin = std::floor((x - lo) / width);
+  int last = counts.size() - 1;
+  int i = (bin < 0.) ? 0 : (last < bin) ? last : static_cast<int>(bin);
+  ++counts[i];
+  ++n;
+}
+
+void
+Histogram::merge(const Histogram &other)
+{
+  assert(counts.size() == other.counts.size());
+  for (size_t i = 0; i < counts.size(); ++i)
+    counts[i] += other.counts[i];
+  n += other.n;
+}
+
+QuantileSketch::QuantileSketch(size_t k)
+  : k(std::max<size_t>(k, 2)), flips(0), levels(1)
+{ }
+
+void
+QuantileSketch::add(double x)
+{
+  levels[0].push_back(x);
+  if (k <= levels[0].size())
+    compact(0);
+}
+
+void
+QuantileSketch::compact(size_t level)
+{
+  if (levels.size() <= level + 1)
+    levels.resize(level + 2);
+
+  std::vector<double> &items = levels[level];
+  std::sort(items.begin(), items.end());
+
+  // An odd value out stays behind so no weight is lost.
+  double leftover = 0.;
+  bool odd = items.size() % 2;
+  if (odd) {
+    leftover = items.back();
+    items.pop_back();
+  }
+
+  std::vector<double> &next = levels[level + 1];
+  for (size_t i = flips++ % 2; i < items.size(); i += 2)
+    next.push_back(items[i]);
+
+  items.clear();
+  if (odd)
+    items.push_back(leftover);
+
+  if (k <= next.size())
+    compact(level + 1);
+}
+
+void
+QuantileSketch::merge(const QuantileSketch &other)
+{
+  if (levels.size() < other.levels.size())
+    levels.resize(other.levels.size());
+  for (size_t i = 0; i < other.levels.size(); ++i)
+    levels[i].insert(levels[i].end(),
+                     other.levels[i].begin(), other.levels[i].end());
+  for (size_t i = 0; i < levels.size(); ++i) {
+    if (k <= levels[i].size())
+      compact(i);
+  }
+}
+
+double
+QuantileSketch::quantile(double q) const
+{
+  std::vector<std::pair<double, double> > weighted;
+  double total = 0.;
+  double weight = 1.;
+  for (size_t i = 0; i < levels.size(); ++i, weight *= 2.) {
+    for (size_t j = 0; j < levels[i].size(); ++j)
+      weighted.push_back(std::make_pair(levels[i][j], weight));
+    total += weight * levels[i].size();
+  }
+  if (weighted.empty())
+    return 0.;
+
+  std::sort(weighted.begin(), weighted.end());
+  double target = q * total;
+  double seen = 0.;
+  for (size_t i = 0; i < weighted.size(); ++i) {
+    seen += weighted[i].second;
+    if (target < seen)
+      return weighted[i].first;
+  }
+  return weighted.back().first;
+}
+
+FeatureStats::FeatureStats(const StatsOptions &options)
+{
+  if (0 < options.nbins)
+    hist.push_back(Histogram(options.lo, options.hi, options.nbins));
+  if (0 < options.sketch_k)
+    quantiles.push_back(QuantileSketch(options.sketch_k));
+}
+
+void
+FeatureStats::add(double x)
+{
+  stats.add(x);
+  if (! hist.empty())
+    hist[0].add(x);
+  if (! quantiles.empty())
+    quantiles[0].add(x);
+}
+
+void
+FeatureStats::merge(const FeatureStats &other)
+{
+  stats.merge(other.stats);
+  if (! hist.empty() && ! other.hist.empty())
+    hist[0].merge(other.hist[0]);
+  if (! quantiles.empty() && ! other.quantiles.empty())
+    quantiles[0].merge(other.quantiles[0]);
+}
+
+double
+separation(const RunningStats &s1, const RunningStats &s2)
+{
+  double spread = s1.variance() + s2.variance();
+  if (s1.count() < 2 || s2.count() < 2 || spread == 0.)
+    return -1.;
+  double delta = s1.mean() - s2.mean();
+  return delta * delta / spread;
+}
+
+double
+overlap(const Histogram &h1, const Histogram &h2)
+{
+  const std::vector<size_t> &b1 = h1.bins();
+  const std::vector<size_t> &b2 = h2.bins();
+  assert(b1.size() == b2.size());
+  if (h1.total() == 0 || h2.total() == 0)
+    return 0.;
+
+  double sum = 0.;
+  for (size_t i = 0; i < b1.size(); ++i)
+    sum += std::sqrt(static_cast<double>(b1[i]) / h1.total() *
+                     static_cast<double>(b2[i]) / h2.total());
+  return sum;
+}
@@ -0,0 +1,113 @@
+#ifndef STATS_INCLUDED
+#define STATS_INCLUDED 1
+
+#include <cstddef>
+#include <vector>
+
+// Count, mean and variance of a stream of values, updated one value at a
+// time with Welford's method.  Two of these can be merged into what one
+// would have seen from both streams.
+class RunningStats
+{
+public:
+  RunningStats() : n(0), ave(0.), m2(0.) {}
+
+  void add(double x);
+  void merge(const RunningStats &other);
+
+  size_t count() const { return n; }
+  double mean() const { return ave; }
+  // Sample variance, or -1 with fewer than two values.
+  double variance() const { return n < 2 ? -1. : m2 / (n - 1); }
+
+private:
+  size_t n;
+  double ave;
+  double m2;
+};
+
+// Counts of values in nbins equal bins over [lo, hi), with everything
+// outside folded into the first or last bin.
+class Histogram
+{
+public:
+  Histogram(double lo, double hi, int nbins);
+
+  void add(double x);
+  void merge(const Histogram &other);
+
+  size_t total() const { return n; }
+  const std::vector<size_t> &bins() const { return counts; }
+
+private:
+  double lo;
+  double width;
+  size_t n;
+  std::vector<size_t> counts;
+};
+
+// Approximate quantiles in bounded memory.  Values are kept in levels of
+// up to k; a full level is sorted and every other value is promoted to
+// the next level, where each counts twice as much.  Which half is kept
+// alternates, so the result is deterministic.  Memory is at most k
+// values per level, and there are log2(n / k) levels.
+class QuantileSketch
+{
+public:
+  explicit QuantileSketch(size_t k = 128);
+
+  void add(double x);
+  void merge(const QuantileSketch &other);
+  double quantile(double q) const;
+
+private:
+  size_t k;
+  unsigned int flips;
+  std::vector<std::vector<double> > levels;
+
+  void compact(size_t level);
+};
+
+// Which optional summaries to keep.  Zero nbins or sketch_k turns the
+// histogram or the quantile sketch off.
+struct StatsOptions {
+  int nbins;
+  double lo;
+  double hi;
+  size_t sketch_k;
+
+  StatsOptions() : nbins(0), lo(0.), hi(1.), sketch_k(0) {}
+};
+
+// The summaries kept for one feature over one character, or over junk.
+class FeatureStats
+{
+public:
+  explicit FeatureStats(const StatsOptions &options = StatsOptions());
+
+  void add(double x);
+  void merge(const FeatureStats &other);
+
+  const RunningStats &moments() const { return stats; }
+  // 0 if the option wasn't set.
+  const Histogram *histogram() const { return hist.empty() ? 0 : &hist[0]; }
+  const QuantileSketch *sketch() const
+  { return quantiles.empty() ? 0 : &quantiles[0]; }
+
+private:
+  RunningStats stats;
+  // Zero or one of each.
+  std::vector<Histogram> hist;
+  std::vector<QuantileSketch> quantiles;
+};
+
+// Fisher's criterion, (mean1 - mean2)^2 / (var1 + var2).  Larger means the
+// two distributions are easier to tell apart.  -1 if either has fewer
+// than two values or both have no spread.
+double separation(const RunningStats &s1, const RunningStats &s2);
+
+// Sum over bins of sqrt(p1 p2), from 0 for no overlap to 1 for the same
+// distribution.  The histograms must have the same bins.
+double overlap(const Histogram &h1, const Histogram &h2);
+
+#endif  // STATS_INCLUDED
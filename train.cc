@@ -1,71 +1,124 @@
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <limits>
-#include <sstream>
 #include <string>
 #include <vector>
 
+#include <unistd.h>
+
 #include <boost/lexical_cast.hpp>
 
 #define CV_NO_BACKWARD_COMPATIBILITY
 #include <opencv/cv.h>
 #include <opencv/highgui.h>
 
+#include "groundtruth.h"
 #include "image.h"
+#include "imageload.h"
+#include "instrument.h"
 #include "keycode.h"
+#include "labels.h"
+#include "objcache.h"
+#include "pipeline.h"
 #include "sql.h"
 
 std::string window_name = "Textection training";
 
-const std::ios_base::openmode SS_BUFFER_MODE =
-  std::stringstream::ate | std::stringstream::out;
-
-static int
-get_key()
+// False if the key was ESC, to quit.
+static bool
+get_key(int &key)
 {
-  int key = cv::waitKey();
-  if (key_code(key) == ESC_CODE)
-    std::exit(0);
-  return key;
+  key = cv::waitKey();
+  return key_code(key) != ESC_CODE;
 }
 
-static int
-show(const cv::Mat &img)
+static bool
+show(const cv::Mat &img, int &key)
 {
   cv::imshow(window_name, img);
-  return get_key();
+  return get_key(key);
 }
 
+// What to do after the user's answer for one object.
+enum feedback_t { NEXT_OBJECT, SKIP_IMAGE, QUIT };
+
+// Each label typed is committed at once, so a crash or a closed window
+// loses no work; with WAL and synchronous=NORMAL a commit is cheap.
+static const size_t LABEL_BATCH_SIZE = 1;
+// Imported labels go in much larger transactions, across images.
+static const size_t IMPORT_BATCH_SIZE = 50000;
+// An object takes a ground truth box's character if at least this much
+// of its bound lies inside the box.
+static const double IMPORT_MIN_OVERLAP = 0.5;
+
 static void
-insert_obj(const Obj &obj, int code, sqlite3 *db,
-           const std::string &table_name)
+insert_obj(const ObjView &obj, int code, const labeling_t &labeling,
+           SqlBulkInsert &labels)
 {
-  std::stringstream buffer("INSERT INTO '", SS_BUFFER_MODE);
-  buffer << table_name << "' (x, y, char) VALUES ("
-         << obj.runs[0].start << ", "
-         << obj.runs[0].row << ", "
-         << code << ");";
-  std::string stmt = buffer.str();
-  SQL_OK(sqlite3_exec(db, stmt.c_str(), 0, 0, 0));
+  labels.row()
+    .bind(1, labeling.image_id)
+    .bind(2, labeling.params_id)
+    .bind(3, obj.runs[0].start)
+    .bind(4, obj.runs[0].row)
+    .bind(5, code);
+  labels.insert();
 }
 
-static bool
-feedback(const cv::Mat &img, const Obj &obj, sqlite3 *db,
-         const std::string &table_name)
+// The image as shown, with one object filled in.  Moving to another
+// object puts back the pixels under the last one's bound and fills the
+// new one's runs, so a keystroke costs two objects' worth of pixels
+// instead of a copy of the whole image.
+class LabelDisplay
+{
+public:
+  explicit LabelDisplay(const cv::Mat &img)
+    : img(img), shown(img.clone()), has_last(false)
+  { }
+
+  // Objects are found on a smoothed copy that can be a pixel wider or
+  // taller than img, so their bounds are clipped to it.
+  const cv::Mat &highlight(const ObjView &obj)
+  {
+    if (has_last) {
+      cv::Mat under(shown, last);
+      cv::Mat(img, last).copyTo(under);
+    }
+    fillobj(shown, obj, cv::Scalar(255, 255, 0));
+    last = obj.bound & cv::Rect(0, 0, img.cols, img.rows);
+    has_last = 0 < last.width && 0 < last.height;
+    return shown;
+  }
+
+private:
+  cv::Mat img;
+  cv::Mat shown;
+  cv::Rect last;
+  bool has_last;
+};
+
+static feedback_t
+feedback(const cv::Mat &img, const ObjView &obj, const labeling_t &labeling,
+         SqlBulkInsert &labels)
 {
-  int key = show(img);
-  int code = key_ascii(key);
-  for ( ; ; code = key_ascii(get_key())) {
+  int key;
+  if (! show(img, key))
+    return QUIT;
+  for ( ; ; ) {
+    int code = key_ascii(key);
     if (code == SPACE_CODE)
-      return false;
+      return NEXT_OBJECT;
     if (code == TAB_CODE)
-      return true;
+      return SKIP_IMAGE;
     if (code < 128 && isprint(code)) {
-      insert_obj(obj, code, db, table_name);
-      return false;
+      insert_obj(obj, code, labeling, labels);
+      return NEXT_OBJECT;
     }
+    if (! get_key(key))
+      return QUIT;
   }
 }
 
@@ -96,88 +149,254 @@ parse_args(char **argv, std::vector<double> &params, std::vector<std::string> &a
   }
 }
 
-static std::string
-construct_table_name(const std::string &filename,
-                     const std::vector<double> &params)
+// An image left part way through, by ESC or a crash, picks up where it
+// stopped: objects labeled before aren't shown again.  Returns false if
+// the user quit.
+static bool
+process_img(image_job_t &job, sqlite3 *db)
 {
-  std::stringstream buffer(filename, SS_BUFFER_MODE);
-  for (size_t i = 0; i < params.size(); ++i) {
-    buffer << ((i == 0) ? '+' : ',');
-    buffer << params[i];
+  labeling_t labeling;
+  labeling.image_id = image_id(db, job.filename);
+  labeling.params_id = params_id(db, job.params[0]);
+  begin_labeling(db, labeling.image_id, labeling.params_id);
+
+  std::vector<label_t> labeled;
+  load_labels(db, labeling.image_id, labeling.params_id, labeled);
+
+  SqlBulkInsert labels(db, "labels", label_columns(), LABEL_BATCH_SIZE);
+
+  LabelDisplay display(job.image);
+  const ObjectSet &objs = job.objs[0];
+  feedback_t action = NEXT_OBJECT;
+  for (size_t i = 0; i < objs.size() && action == NEXT_OBJECT; ++i) {
+    Run first = objs[i].runs[0];
+    if (find_label(labeled, first.start, first.row))
+      continue;
+    action = feedback(display.highlight(objs[i]), objs[i], labeling, labels);
   }
-  return buffer.str();
+  labels.finish();
+  if (action == QUIT)
+    return false;
+  finish_labeling(db, labeling.image_id, labeling.params_id);
+  return true;
 }
 
 static bool
-table_exists(const std::string &name, sqlite3 *db)
+is_done(const std::string &name, const std::vector<double> &params,
+        sqlite3 *db)
 {
-  bool exists = false;
-  std::stringstream buffer(
-    "SELECT name FROM sqlite_master WHERE type='table' AND name='",
-    SS_BUFFER_MODE
-    );
-  buffer << name << "';";
-  std::string stmt = buffer.str();
-
-  sqlite3_stmt *bytecode;
-  SQL_OK(sqlite3_prepare_v2(db, stmt.data(), stmt.size(), &bytecode, 0));
-
-  int res = sqlite3_step(bytecode);
-  if (res == SQLITE_ROW)
-    exists = true;
-  else
-    SQL_CHECK(res, SQLITE_DONE);
-
-  SQL_OK(sqlite3_finalize(bytecode));
-  return exists;
+  labeling_t labeling;
+  return find_labeling(db, image_id(db, name), params_id(db, params),
+                       labeling) && labeling.done;
 }
 
+// Pipeline::dispose_t for jobs the loop never got to.
 static void
-create_object_table(const std::string &name, sqlite3 *db)
+delete_job(void *item, void *)
 {
-  std::stringstream buffer("CREATE TABLE '", SS_BUFFER_MODE);
-  buffer << name << "' (x INTEGER, y INTEGER, char INTEGER)";
-  std::string stmt = buffer.str();
-  SQL_OK(sqlite3_exec(db, stmt.c_str(), 0, 0, 0));
+  delete static_cast<image_job_t *>(item);
 }
 
+struct import_counts_t {
+  size_t images;
+  size_t labels;
+  size_t boxes;
+  size_t unusable_boxes;
+  size_t unmatched_boxes;
+
+  import_counts_t()
+    : images(0), labels(0), boxes(0), unusable_boxes(0), unmatched_boxes(0)
+  {}
+};
+
+// Labels the object that best fits each of the boxes in truth_file with
+// the box's character, as if it had been typed in.  Other objects in a
+// box, such as the counter of an o, are left alone.
 static void
-process_img(const std::string &name, const std::vector<double> &params,
-            sqlite3 *db)
+import_img(image_job_t &job, const std::string &truth_file, sqlite3 *db,
+           SqlBulkInsert &labels, import_counts_t &counts)
 {
-  std::string table_name = construct_table_name(name, params);
-  if (table_exists(table_name, db))
+  std::vector<truth_box_t> boxes;
+  if (! load_ground_truth(truth_file, boxes, &counts.unusable_boxes)) {
+    std::cerr << "Can't read ground truth " << truth_file << std::endl;
     return;
+  }
+  counts.boxes += boxes.size();
 
-  create_object_table(table_name, db);
+  labeling_t labeling;
+  labeling.image_id = image_id(db, job.filename);
+  labeling.params_id = params_id(db, job.params[0]);
+  begin_labeling(db, labeling.image_id, labeling.params_id);
 
-  cv::Mat img = cv::imread(name);
-  std::vector<Obj> objs;
-  get_sorted_objects_from_image(img, objs, params);
+  std::vector<label_t> labeled;
+  load_labels(db, labeling.image_id, labeling.params_id, labeled);
 
-  bool skip = false;
-  for (size_t i = 0; i < objs.size() && !skip; ++i) {
-    cv::Mat m = img.clone();
-    fillobj(m, objs[i], cv::Scalar(255, 255, 0));
-    skip = feedback(m, objs[i], db, table_name);
+  const ObjectSet &objs = job.objs[0];
+  std::vector<const truth_box_t *> matches;
+  counts.unmatched_boxes +=
+    BoxIndex(boxes).match(objs.bounds, IMPORT_MIN_OVERLAP, matches);
+  for (size_t i = 0; i < objs.size(); ++i) {
+    const truth_box_t *box = matches[i];
+    if (! box)
+      continue;
+    Run first = objs[i].runs[0];
+    if (find_label(labeled, first.start, first.row))
+      continue;
+    insert_obj(objs[i], box->c, labeling, labels);
+    ++counts.labels;
   }
+  finish_labeling(db, labeling.image_id, labeling.params_id);
+  ++counts.images;
+}
+
+// Each line of the manifest is an image and its ground truth file,
+// separated by a tab, or by the last space if there is no tab.
+static bool
+read_manifest(const std::string &filename, std::vector<std::string> &images,
+              std::vector<std::string> &truth_files)
+{
+  std::ifstream in(filename.c_str());
+  if (! in)
+    return false;
+  std::string line;
+  while (std::getline(in, line)) {
+    if (! line.empty() && line[line.size() - 1] == '\r')
+      line.erase(line.size() - 1);
+    if (line.empty() || line[0] == '#')
+      continue;
+    size_t split = line.find('\t');
+    if (split == std::string::npos)
+      split = line.rfind(' ');
+    if (split == std::string::npos) {
+      std::cerr << "No ground truth file for " << line << std::endl;
+      continue;
+    }
+    images.push_back(line.substr(0, split));
+    truth_files.push_back(line.substr(split + 1));
+  }
+  return true;
+}
+
+// Headless: objects are found on every core and labeled from ground
+// truth, with no window.  Images already done are skipped, and objects
+// already labeled keep their labels.
+static int
+import_manifest(const std::string &manifest,
+                const std::vector<double> &params, sqlite3 *db)
+{
+  std::vector<std::string> images;
+  std::vector<std::string> truth_files;
+  if (! read_manifest(manifest, images, truth_files)) {
+    std::cerr << "Can't read manifest " << manifest << std::endl;
+    return 1;
+  }
+
+  std::vector<void *> jobs;
+  for (size_t n = 0; n < images.size(); ++n) {
+    if (is_done(images[n], params, db))
+      continue;
+    image_job_t *job = new image_job_t;
+    job->index = n;
+    job->filename = images[n];
+    job->params.push_back(params);
+    jobs.push_back(job);
+  }
+
+  int nthreads = std::max(static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)),
+                          1);
+  ObjCache cache(labeler_signature());
+  ImageLoader loader(cache, 1, nthreads, nthreads, nthreads);
+  Pipeline pipeline(nthreads);
+  loader.add_stages(pipeline);
+  pipeline.start(jobs);
+
+  SqlBulkInsert labels(db, "labels", label_columns(), IMPORT_BATCH_SIZE);
+  import_counts_t counts;
+  void *item;
+  while (pipeline.next(item)) {
+    image_job_t *job = static_cast<image_job_t *>(item);
+    import_img(*job, truth_files[job->index], db, labels, counts);
+    log_profile(job->filename, job->profile);
+    delete job;
+  }
+  pipeline.finish();
+  labels.finish();
+
+  std::cerr << counts.labels << " labels from " << counts.boxes
+            << " boxes in " << counts.images << " images";
+  if (counts.unusable_boxes)
+    std::cerr << "; " << counts.unusable_boxes
+              << " boxes skipped for not holding one character";
+  if (counts.unmatched_boxes)
+    std::cerr << "; " << counts.unmatched_boxes
+              << " boxes matched no object";
+  std::cerr << std::endl;
+  return 0;
 }
 
 int
 main(int argc, char **argv)
 {
+  const char *filename = "objs.sqlite";
   sqlite3 *db;
-  SQL_OK(open_sql_db_and_ensure_close_on_exit("objs.sqlite", &db));
-
-  cv::namedWindow(window_name, CV_WINDOW_AUTOSIZE);
+  SQL_OK(open_sql_db_and_ensure_close_on_exit(filename, &db));
+  if (! check_no_legacy_label_tables(db, filename))
+    return 1;
+  set_sql_durability(db, "WAL", "NORMAL");
+  ensure_label_schema(db);
 
   std::vector<std::string> args;
   std::vector<double> params;
   params.push_back(8);
   parse_args(argv + 1, params, args);
 
-  for (size_t n = 0; n < args.size(); ++n)
-    process_img(args[n], params, db);
+  // train --import MANIFEST [params].  The legacy check above covers
+  // imports too.
+  if (! args.empty() && args[0] == "--import") {
+    if (args.size() != 2) {
+      std::cerr << "Usage: train --import MANIFEST [params]" << std::endl;
+      return 1;
+    }
+    return import_manifest(args[1], params, db);
+  }
+
+  cv::namedWindow(window_name, CV_WINDOW_AUTOSIZE);
+
+  std::vector<void *> jobs;
+  for (size_t n = 0; n < args.size(); ++n) {
+    if (is_done(args[n], params, db))
+      continue;
+    image_job_t *job = new image_job_t;
+    job->index = n;
+    job->filename = args[n];
+    job->params.push_back(params);
+    job->keep_image = true;
+    jobs.push_back(job);
+  }
+
+  // The next image is read and its objects found while the current one
+  // is being labeled, on as many tiles as there are cores.
+  int ncores = std::max(static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)), 1);
+  ObjCache cache(labeler_signature());
+  ImageLoader loader(cache, 1, 1, 1, 1, ncores);
+  Pipeline pipeline;
+  loader.add_stages(pipeline);
+  pipeline.start(jobs);
+
+  // On ESC the images already on their way, and those not yet started,
+  // are freed, and the loader threads are joined before the database is
+  // closed.
+  void *item;
+  bool quit = false;
+  while (! quit && pipeline.next(item)) {
+    image_job_t *job = static_cast<image_job_t *>(item);
+    quit = ! process_img(*job, db);
+    log_profile(job->filename, job->profile);
+    delete job;
+  }
+  if (quit)
+    pipeline.stop();
+  pipeline.finish(delete_job, 0);
 
   return 0;
 }